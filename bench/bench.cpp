@@ -0,0 +1,394 @@
+#include "density_filter.hpp"
+#include "histogram.hpp"
+#include "ifs.hpp"
+#include "images.hpp"
+#include "muspelheim.hpp"
+#include "pfm_writer.hpp"
+#include "png_writer.hpp"
+#include "program_options.hpp"
+#include "random.hpp"
+#include "render.hpp"
+#include "simd.hpp"
+#include "thread_pool.hpp"
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/gil/typedefs.hpp>
+
+// Benchmarks for each stage of the render pipeline, run against whichever
+// flame this is linked with (one binary per gallery flame). Each benchmark
+// reports how many items (iterations or pixels) it processed per second.
+
+namespace {
+
+  using clock = std::chrono::steady_clock;
+  using rgb8 = boost::gil::rgb8_pixel_t;
+  using dims_t = boost::gil::point2<ptrdiff_t>;
+
+  struct result {
+    std::string name;
+    std::string unit;
+    ptrdiff_t size;
+    size_t items;
+    size_t reps;
+    double seconds; // best time for one rep
+  };
+
+  class runner {
+  public:
+    runner(double min_time, std::optional<std::string> filter)
+      : min_time_(min_time), filter_(std::move(filter)) {}
+
+    // Run `f` (which processes `items` of `unit` per call) until at least
+    // `min_time` seconds have passed, and keep the fastest rep.
+    void operator ()(const std::string &name, const std::string &unit,
+                     ptrdiff_t size, size_t items,
+                     const std::function<void()> &f) {
+      if(filter_ && name.find(*filter_) == std::string::npos)
+        return;
+
+      double best = std::numeric_limits<double>::infinity(), total = 0;
+      size_t reps = 0;
+      do {
+        auto start = clock::now();
+        f();
+        double elapsed = std::chrono::duration<double>(
+          clock::now() - start
+        ).count();
+        best = std::min(best, elapsed);
+        total += elapsed;
+        reps++;
+      } while(total < min_time_);
+
+      results_.push_back({name, unit, size, items, reps, best});
+      if(progress_)
+        progress_(results_.back());
+    }
+
+    void on_result(std::function<void(const result &)> f) {
+      progress_ = std::move(f);
+    }
+
+    const std::vector<result> & results() const {
+      return results_;
+    }
+  private:
+    double min_time_;
+    std::optional<std::string> filter_;
+    std::vector<result> results_;
+    std::function<void(const result &)> progress_;
+  };
+
+  // Keep the optimizer from discarding a result.
+  template<typename T>
+  inline void do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  void print_text(const result &r) {
+    double per_second = r.items / r.seconds;
+    std::cout << std::left << std::setw(28) << r.name << std::right
+              << std::setw(6) << r.size << std::setw(12) << r.items
+              << std::setw(6) << r.reps << std::fixed << std::setprecision(3)
+              << std::setw(12) << r.seconds * 1e3 << " ms"
+              << std::setw(14) << std::setprecision(0) << per_second << " "
+              << r.unit << "/s" << std::setw(10) << std::setprecision(2)
+              << r.seconds * 1e9 / r.items << " ns/" << r.unit << std::endl;
+  }
+
+  void print_json(const std::string &flame, size_t threads,
+                  const std::vector<result> &results) {
+    std::cout << "{\n  \"flame\": \"" << flame << "\",\n"
+              << "  \"simd\": \"" << simd::name(simd::active()) << "\",\n"
+              << "  \"threads\": " << threads << ",\n"
+              << "  \"results\": [";
+    for(size_t i = 0; i != results.size(); i++) {
+      const auto &r = results[i];
+      std::cout << (i ? ",\n" : "\n") << std::setprecision(9)
+                << "    {\"name\": \"" << r.name << "\", \"unit\": \""
+                << r.unit << "\", \"size\": " << r.size << ", \"items\": "
+                << r.items << ", \"reps\": " << r.reps << ", \"seconds\": "
+                << r.seconds << ", \"per_second\": " << r.items / r.seconds
+                << ", \"ns_per_item\": " << r.seconds * 1e9 / r.items << "}";
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+  }
+
+  const char * variation_name(math::variation_type type) {
+    using math::variation_type;
+    switch(type) {
+    case variation_type::linear:       return "linear";
+    case variation_type::sinusoidal:   return "sinusoidal";
+    case variation_type::spherical:    return "spherical";
+    case variation_type::swirl:        return "swirl";
+    case variation_type::handkerchief: return "handkerchief";
+    case variation_type::spiral:       return "spiral";
+    default:                           return "custom";
+    }
+  }
+
+  void bench_variations(runner &run, size_t steps) {
+    using math::variation_type;
+
+    // A fixed set of points spread over the usual [-1, 1] range, so that
+    // every variation sees the same inputs.
+    rng::xoshiro256pp engine(1);
+    std::vector<math::vec2d> points(4096);
+    for(auto &p : points) {
+      p = math::vec2d(2 * rng::canonical(engine) - 1,
+                      2 * rng::canonical(engine) - 1);
+    }
+
+    auto transform = math::scale(0.7) * math::rotate(0.4);
+    for(auto type : {variation_type::linear, variation_type::sinusoidal,
+                     variation_type::spherical, variation_type::swirl,
+                     variation_type::handkerchief, variation_type::spiral}) {
+      // Use a post transform too, so that linear can't be folded away.
+      ifs::iterated_function<rgb8> f(type, transform, rgb8(255, 255, 255),
+                                     math::translate(0.1, 0));
+      for(auto precision : {math::precision::exact, math::precision::fast}) {
+        // Only the variations with transcendental functions have a fast
+        // version.
+        bool fast = precision == math::precision::fast;
+        if(fast && (type == variation_type::linear ||
+                    type == variation_type::spherical))
+          continue;
+
+        run(std::string("variation/") + variation_name(type) +
+            (fast ? "/fast" : ""), "iter", 0, steps, [&]() {
+              for(size_t i = 0; i != steps; i++)
+                do_not_optimize(f(points[i % points.size()], precision));
+            });
+      }
+    }
+  }
+
+  void bench_chaos_game(runner &run, ptrdiff_t size, size_t steps) {
+    const auto &funcs = muspelheim::function_system;
+    run("chaos_game", "iter", size, steps, [&]() {
+      auto data = ifs::chaos_game(funcs, dims_t(size, size), steps);
+      do_not_optimize(data.color);
+    });
+    run("chaos_game/compact", "iter", size, steps, [&]() {
+      auto data = ifs::chaos_game<images::compact_count>(
+        funcs, dims_t(size, size), steps
+      );
+      do_not_optimize(data.color);
+    });
+    run("chaos_game/checked", "iter", size, steps, [&]() {
+      auto data = ifs::chaos_game<images::checked_count>(
+        funcs, dims_t(size, size), steps
+      );
+      do_not_optimize(data.color);
+    });
+    run("chaos_game/float", "iter", size, steps, [&]() {
+      auto data = ifs::chaos_game<uint32_t, float>(
+        funcs, dims_t(size, size), steps
+      );
+      do_not_optimize(data.color);
+    });
+    run("chaos_game/fast", "iter", size, steps, [&]() {
+      auto data = ifs::chaos_game(funcs, dims_t(size, size), steps,
+                                  math::precision::fast);
+      do_not_optimize(data.color);
+    });
+    run("chaos_game/float/fast", "iter", size, steps, [&]() {
+      auto data = ifs::chaos_game<uint32_t, float>(
+        funcs, dims_t(size, size), steps, math::precision::fast
+      );
+      do_not_optimize(data.color);
+    });
+  }
+
+  void bench_images(runner &run, ptrdiff_t size, size_t steps,
+                    parallel::thread_pool &pool) {
+    using namespace boost::gil;
+    const auto &funcs = muspelheim::function_system;
+    const auto palette = funcs.palette();
+    dims_t dims(size, size);
+    size_t pixels = size * size;
+
+    // Give every image stage a realistic histogram to work on.
+    std::vector<images::raw_image_data<>> parts;
+    for(int i = 0; i != 4; i++)
+      parts.push_back(ifs::chaos_game(funcs, dims, steps / 4));
+
+    run("combine/4", "px", size, pixels, [&]() {
+      do_not_optimize(images::combine(parts).color);
+    });
+
+    std::vector<images::raw_image_view<>> part_views;
+    for(auto &part : parts)
+      part_views.push_back(part.view());
+    images::raw_image_data<> merged(dims);
+    images::merge(part_views, merged.view());
+    run("merge/4", "px", size, pixels, [&]() {
+      images::merge(part_views, merged.view());
+    });
+    run("merge/4/pool", "px", size, pixels, [&]() {
+      images::merge(part_views, merged.view(), &pool);
+    });
+
+    const auto &raw = merged;
+    run("log_alpha", "px", size, pixels, [&]() {
+      do_not_optimize(images::log_alpha(raw, palette).alpha);
+    });
+    run("linear_alpha", "px", size, pixels, [&]() {
+      do_not_optimize(images::linear_alpha(raw, palette).alpha);
+    });
+
+    auto cooked = images::log_alpha(raw, palette);
+    auto linear = images::linear_alpha(raw, palette);
+    rgb8_image_t out(dims), highlight(dims);
+    auto out_view = view(out);
+    auto highlight_view = view(highlight);
+    run("render", "px", size, pixels, [&]() {
+      images::render(out_view, cooked);
+    });
+    images::render_monochrome(highlight_view, linear, rgb8(255, 255, 255));
+    run("lighten", "px", size, pixels, [&]() {
+      images::lighten(out_view, const_view(highlight));
+    });
+
+    images::tone_map_options hdr = {1.0, 1.0};
+    run("tone_map", "px", size, pixels, [&]() {
+      images::tone_map(out_view, raw, palette, hdr);
+    });
+    run("tone_map/pool", "px", size, pixels, [&]() {
+      images::tone_map(out_view, raw, palette, hdr, &pool);
+    });
+    run("write_png", "px", size, pixels, [&]() {
+      images::write_png("/dev/null", raw, palette, hdr, &pool);
+    });
+    run("write_png/16", "px", size, pixels, [&]() {
+      images::write_png("/dev/null", raw, palette, hdr, &pool, nullptr, 16);
+    });
+    run("write_pfm", "px", size, pixels, [&]() {
+      images::tone_mapper<rgb8> mapper(raw, palette, hdr, &pool);
+      images::write_pfm("/dev/null", mapper, &pool);
+    });
+
+    // The filters run at the histogram's size, so these count its pixels.
+    images::filter_options de;
+    de.de_max_radius = 9;
+    run("density_estimation", "px", size, pixels, [&]() {
+      do_not_optimize(images::filter_histogram(merged.view(), de).color);
+    });
+    run("density_estimation/pool", "px", size, pixels, [&]() {
+      do_not_optimize(images::filter_histogram(merged.view(), de,
+                                               &pool).color);
+    });
+    images::filter_options half;
+    half.oversample = 2;
+    run("downsample/2/pool", "px", size, pixels, [&]() {
+      do_not_optimize(images::filter_histogram(merged.view(), half,
+                                               &pool).color);
+    });
+  }
+
+  // Everything the driver does, from an empty histogram to an encoded image.
+  void bench_pipeline(runner &run, ptrdiff_t size, size_t steps,
+                      parallel::thread_pool &pool) {
+    const auto &funcs = muspelheim::function_system;
+    const auto palette = funcs.palette();
+    run("pipeline", "iter", size, steps, [&]() {
+      images::shared_image_data<> histogram(dims_t(size, size));
+      ifs::render_budget budget;
+      budget.steps = steps;
+      ifs::render(funcs, histogram, pool, budget);
+      images::write_png("/dev/null", histogram.view(), palette, {1.0, 1.0},
+                        &pool);
+    });
+    run("pipeline/compact", "iter", size, steps, [&]() {
+      images::shared_image_data<images::compact_count> histogram(
+        dims_t(size, size)
+      );
+      ifs::render_budget budget;
+      budget.steps = steps;
+      ifs::render(funcs, histogram, pool, budget);
+      images::write_png("/dev/null", histogram.view(), palette, {1.0, 1.0},
+                        &pool);
+    });
+  }
+
+}
+
+int main(int argc, const char *argv[]) {
+  namespace opts = boost::program_options;
+
+  bool show_help = false;
+  bool json = false;
+  std::vector<ptrdiff_t> sizes;
+  std::vector<size_t> step_counts;
+  size_t num_jobs = parallel::thread_pool::default_size();
+  double min_time = 0.5;
+  std::optional<std::string> filter;
+
+  opts::options_description desc("Options");
+  desc.add_options()
+    ("help,h", opts::value(&show_help)->zero_tokens(), "show help")
+    ("json", opts::value(&json)->zero_tokens(),
+     "print results as JSON")
+    ("size,s", opts::value(&sizes)->value_name("SIZE")->multitoken(),
+     "image sizes to test (default: 256 666 2048)")
+    ("steps,n", opts::value(&step_counts)->value_name("N")->multitoken(),
+     "iteration counts to test (default: 100000 1000000 10000000)")
+    ("jobs,j", opts::value(&num_jobs)->value_name("JOBS"),
+     "number of worker threads for the parallel stages")
+    ("min-time", opts::value(&min_time)->value_name("SECONDS"),
+     "repeat each benchmark for at least SECONDS")
+    ("filter", opts::value(&filter)->value_name("NAME"),
+     "only run benchmarks whose name contains NAME")
+  ;
+
+  try {
+    opts::variables_map vm;
+    opts::store(opts::parse_command_line(argc, argv, desc), vm);
+    opts::notify(vm);
+  } catch(const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+
+  if(show_help) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  if(sizes.empty())
+    sizes = {256, 666, 2048};
+  if(step_counts.empty())
+    step_counts = {100000, 1000000, 10000000};
+
+  std::string flame = argv[0];
+  flame = flame.substr(flame.find_last_of('/') + 1);
+
+  runner run(min_time, filter);
+  if(!json)
+    run.on_result(print_text);
+
+  parallel::thread_pool pool(num_jobs);
+  size_t max_steps = *std::max_element(step_counts.begin(),
+                                       step_counts.end());
+
+  bench_variations(run, 1000000);
+  for(auto size : sizes) {
+    for(auto steps : step_counts)
+      bench_chaos_game(run, size, steps);
+  }
+  for(auto size : sizes)
+    bench_images(run, size, max_steps, pool);
+  for(auto size : sizes)
+    bench_pipeline(run, size, max_steps, pool);
+
+  if(json)
+    print_json(flame, pool.size(), run.results());
+  return 0;
+}
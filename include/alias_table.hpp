@@ -0,0 +1,102 @@
+#ifndef INC_MUSPELHEIM_ALIAS_TABLE_HPP
+#define INC_MUSPELHEIM_ALIAS_TABLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "random.hpp"
+
+namespace rng {
+
+  // Sample indices from a discrete distribution in O(1) using Vose's variant
+  // of Walker's alias method.
+  class alias_table {
+  public:
+    alias_table() = default;
+
+    template<typename Iter>
+    alias_table(Iter first, Iter last) {
+      std::vector<double> weights(first, last);
+      build(weights);
+    }
+
+    explicit alias_table(const std::vector<double> &weights) {
+      build(weights);
+    }
+
+    // Draw one index, using a single 64-bit draw for both the slot and the
+    // coin flip within it.
+    template<typename Engine>
+    inline size_t operator ()(Engine &engine) const {
+      uint64_t fraction;
+      size_t i = rng::scale(rng::bits(engine), size(), fraction);
+      return fraction < threshold_[i] ? i : alias_[i];
+    }
+
+    inline size_t size() const {
+      return threshold_.size();
+    }
+
+    inline bool empty() const {
+      return threshold_.empty();
+    }
+  private:
+    void build(std::vector<double> weights) {
+      double total = 0;
+      for(auto w : weights) {
+        if(!(w >= 0))
+          throw std::invalid_argument("weights must be non-negative");
+        total += w;
+      }
+      if(!(total > 0))
+        throw std::invalid_argument("weights must have a positive sum");
+
+      const size_t n = weights.size();
+      std::vector<double> prob(n, 1.0);
+      alias_.resize(n);
+      for(size_t i = 0; i != n; i++)
+        alias_[i] = static_cast<uint32_t>(i);
+
+      std::vector<uint32_t> small, large;
+      for(size_t i = 0; i != n; i++) {
+        weights[i] *= n / total;
+        (weights[i] < 1 ? small : large).push_back(static_cast<uint32_t>(i));
+      }
+
+      while(!small.empty() && !large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back();
+
+        prob[s] = weights[s];
+        alias_[s] = l;
+        weights[l] -= 1 - weights[s];
+        if(weights[l] < 1) {
+          large.pop_back();
+          small.push_back(l);
+        }
+      }
+
+      // Anything left over is 1 up to rounding error, so leave it at 1; its
+      // alias is itself, so the threshold doesn't matter.
+      threshold_.resize(n);
+      for(size_t i = 0; i != n; i++) {
+        threshold_[i] = prob[i] >= 1 ? std::numeric_limits<uint64_t>::max()
+                                     : static_cast<uint64_t>(
+                                         std::ldexp(prob[i], 64)
+                                       );
+      }
+    }
+
+    // Slot i yields i if the fraction is below threshold_[i] (prob * 2^64),
+    // and alias_[i] otherwise.
+    std::vector<uint64_t> threshold_;
+    std::vector<uint32_t> alias_;
+  };
+
+} // namespace rng
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef INC_MUSPELHEIM_ANIMATION_HPP
+#define INC_MUSPELHEIM_ANIMATION_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "ifs.hpp"
+#include "palette.hpp"
+
+namespace ifs {
+
+  // Interpolate linearly from `a` (at t = 0) to `b` (at t = 1): every
+  // function's affines, variation weights, color, weight and color index,
+  // the xaos matrix, and the camera (with the zoom interpolated
+  // geometrically, so that a zoom moves at a steady rate). Both must have
+  // the same shape: the same number of functions, each with the same
+  // variations in the same order, the same size of xaos matrix and the same
+  // symmetry. Custom variations are taken from `a`.
+  template<typename Pixel>
+  iterated_function_system<Pixel>
+  interpolate(const iterated_function_system<Pixel> &a,
+              const iterated_function_system<Pixel> &b, double t) {
+    using function_t = iterated_function<Pixel>;
+
+    if(a.size() != b.size())
+      throw std::invalid_argument("keyframes have different functions");
+    if(a.xaos().size() != b.xaos().size())
+      throw std::invalid_argument("keyframes have different xaos matrices");
+    if(a.symmetry() != b.symmetry())
+      throw std::invalid_argument("keyframes have different symmetries");
+
+    auto lerp = [t](const auto &x, const auto &y) {
+      return x * (1 - t) + y * t;
+    };
+
+    std::vector<function_t> funcs;
+    for(size_t i = 0; i != a.size(); i++) {
+      const auto &fa = a[i], &fb = b[i];
+      const auto &va = fa.variations(), &vb = fb.variations();
+      if(va.size() != vb.size())
+        throw std::invalid_argument("keyframes have different variations");
+
+      std::vector<typename function_t::value_type> variations;
+      for(size_t j = 0; j != va.size(); j++) {
+        if(va[j].first.type() != vb[j].first.type())
+          throw std::invalid_argument("keyframes have different variations");
+        variations.emplace_back(va[j].first, lerp(va[j].second, vb[j].second));
+      }
+
+      funcs.emplace_back(
+        std::move(variations), lerp(fa.transform(), fb.transform()),
+        colors::mix(fa.color(), fb.color(), t), lerp(fa.post(), fb.post()),
+        lerp(fa.weight(), fb.weight()),
+        lerp(fa.color_index(), fb.color_index())
+      );
+    }
+
+    auto xaos = a.xaos();
+    for(size_t i = 0; i != xaos.size(); i++) {
+      for(size_t j = 0; j != xaos[i].size(); j++)
+        xaos[i][j] = lerp(xaos[i][j], b.xaos()[i].at(j));
+    }
+
+    const auto &ca = a.camera(), &cb = b.camera();
+    ifs::camera cam;
+    cam.center = lerp(ca.center, cb.center);
+    cam.zoom = std::pow(ca.zoom, 1 - t) * std::pow(cb.zoom, t);
+    cam.rotation = lerp(ca.rotation, cb.rotation);
+
+    iterated_function_system<Pixel> result(std::move(funcs), std::move(xaos),
+                                           a.symmetry());
+    result.set_camera(cam);
+    return result;
+  }
+
+  // The function system for `frame` of an animation of `frames` frames
+  // passing through each of `keys` in turn, spending the same number of
+  // frames between each pair. The first and last frames are exactly the
+  // first and last keys.
+  template<typename Pixel>
+  iterated_function_system<Pixel>
+  keyframe_at(const std::vector<iterated_function_system<Pixel>> &keys,
+              size_t frame, size_t frames) {
+    assert(!keys.empty() && frame < frames);
+    if(keys.size() == 1 || frames == 1)
+      return keys.front();
+
+    double pos = static_cast<double>(frame) * (keys.size() - 1) /
+      (frames - 1);
+    size_t k = std::min(static_cast<size_t>(pos), keys.size() - 2);
+    return interpolate(keys[k], keys[k + 1], pos - k);
+  }
+
+} // namespace ifs
+
+#endif
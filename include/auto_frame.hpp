@@ -0,0 +1,112 @@
+#ifndef INC_MUSPELHEIM_AUTO_FRAME_HPP
+#define INC_MUSPELHEIM_AUTO_FRAME_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <boost/gil/point.hpp>
+
+#include "camera.hpp"
+#include "ifs.hpp"
+#include "random.hpp"
+
+namespace ifs {
+
+  // How auto_frame() finds the attractor. `samples` points (and their
+  // images under the flame's symmetry) are taken from a short run of the
+  // chaos game; the box between the `quantile` and 1 - `quantile` quantiles
+  // of their coordinates is taken as the attractor's extent, so a few
+  // far-flung outliers don't shrink the flame to a speck. The box is then
+  // padded by `margin` of its size on each side.
+  struct frame_options {
+    double quantile = 0.005;
+    double margin = 0.05;
+    size_t samples = 1 << 16;
+    uint64_t seed = 0;
+  };
+
+  namespace detail {
+    // The `q` quantile of `values`, which are reordered.
+    inline double quantile(std::vector<double> &values, double q) {
+      assert(!values.empty());
+      auto n = static_cast<size_t>(q * (values.size() - 1));
+      std::nth_element(values.begin(), values.begin() + n, values.end());
+      return values[n];
+    }
+  }
+
+  // A camera, keeping `funcs`'s own rotation, that fits the density of
+  // `funcs` onto a canvas of `dimensions` pixels, so that a render spends
+  // its iterations and pixels on the part of the plane that's actually
+  // drawn. The pre-pass is only a few hundred steps of a walker_batch, far
+  // cheaper than any real render. If the samples don't span a box (e.g. the
+  // attractor is a point, or diverges), the flame's camera is returned as
+  // is.
+  template<typename Pixel>
+  ifs::camera auto_frame(const iterated_function_system<Pixel> &funcs,
+                         const boost::gil::point2<ptrdiff_t> &dimensions,
+                         const frame_options &opts = {}) {
+    assert(opts.quantile >= 0 && opts.quantile < 0.5);
+    ifs::camera cam = funcs.camera();
+
+    // Measure in the camera's own orientation, so the box is aligned with
+    // the canvas.
+    const auto unrotate = math::rotate(-cam.rotation);
+    std::vector<math::affine_transform> images;
+    for(const auto &g : funcs.symmetry().transforms())
+      images.push_back(unrotate * g);
+
+    rng::xoshiro256pp engine(opts.seed);
+    walker_batch<Pixel> walkers(funcs);
+    walkers.seed(engine);
+
+    std::vector<double> xs, ys;
+    xs.reserve(opts.samples * images.size());
+    ys.reserve(opts.samples * images.size());
+    for(size_t i = 0; i < opts.samples; i += walkers.size()) {
+      walkers.step(engine);
+      size_t lanes = std::min(walkers.size(), opts.samples - i);
+      for(size_t lane = 0; lane != lanes; lane++) {
+        for(const auto &g : images) {
+          auto p = g(walkers.point(lane));
+          if(std::isfinite(p.x) && std::isfinite(p.y)) {
+            xs.push_back(p.x);
+            ys.push_back(p.y);
+          }
+        }
+      }
+    }
+    if(xs.empty())
+      return cam;
+
+    double x0 = detail::quantile(xs, opts.quantile);
+    double x1 = detail::quantile(xs, 1 - opts.quantile);
+    double y0 = detail::quantile(ys, opts.quantile);
+    double y1 = detail::quantile(ys, 1 - opts.quantile);
+    double w = (x1 - x0) * (1 + 2 * opts.margin);
+    double h = (y1 - y0) * (1 + 2 * opts.margin);
+    if(!(w > 0 || h > 0))
+      return cam;
+
+    // At zoom z the canvas shows a width of 2 / z times its width over its
+    // shorter side (and likewise for the height); pick the largest zoom
+    // that fits both.
+    const double dw = dimensions.x, dh = dimensions.y;
+    const double shorter = std::min(dw, dh);
+    double zoom = std::min(w > 0 ? 2 * dw / (shorter * w) : INFINITY,
+                           h > 0 ? 2 * dh / (shorter * h) : INFINITY);
+
+    cam.center = math::rotate(cam.rotation)(
+      math::vec2d{(x0 + x1) / 2, (y0 + y1) / 2}
+    );
+    cam.zoom = zoom;
+    return cam;
+  }
+
+} // namespace ifs
+
+#endif
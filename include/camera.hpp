@@ -0,0 +1,45 @@
+#ifndef INC_MUSPELHEIM_CAMERA_HPP
+#define INC_MUSPELHEIM_CAMERA_HPP
+
+#include <algorithm>
+#include <cstddef>
+
+#include <boost/gil/point.hpp>
+
+#include "vec2d.hpp"
+
+namespace ifs {
+
+  // Where a flame is viewed from: the canvas is centered on `center`,
+  // magnified `zoom` times and turned by `rotation` radians (so the flame
+  // appears turned the other way). At zoom 1, the square [-1, 1]^2 just
+  // fits the canvas's shorter side; a wider or taller canvas shows more of
+  // the plane in that direction.
+  struct camera {
+    math::vec2d center = {0, 0};
+    double zoom = 1;
+    double rotation = 0;
+
+    // The map from the plane to canvas coordinates, where pixel (x, y)
+    // covers [x, x + 1) by [y, y + 1).
+    math::affine_transform
+    to_canvas(const boost::gil::point2<ptrdiff_t> &dimensions) const {
+      double w = dimensions.x, h = dimensions.y;
+      double s = zoom * std::min(w, h) / 2;
+      return math::translate(w / 2, h / 2) * math::scale(s) *
+        math::rotate(-rotation) * math::translate(-center.x, -center.y);
+    }
+
+    friend bool operator ==(const camera &lhs, const camera &rhs) {
+      return lhs.center.x == rhs.center.x && lhs.center.y == rhs.center.y &&
+        lhs.zoom == rhs.zoom && lhs.rotation == rhs.rotation;
+    }
+
+    friend bool operator !=(const camera &lhs, const camera &rhs) {
+      return !(lhs == rhs);
+    }
+  };
+
+} // namespace ifs
+
+#endif
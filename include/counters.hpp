@@ -0,0 +1,346 @@
+#ifndef INC_MUSPELHEIM_COUNTERS_HPP
+#define INC_MUSPELHEIM_COUNTERS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+#include <boost/gil/image.hpp>
+
+namespace images {
+
+  // Hit counters for the alpha plane of a raw_image_data. Plain unsigned
+  // integers (uint32_t by default) saturate (see plot() in histogram.hpp);
+  // checked_count is a 64-bit counter that throws instead of wrapping;
+  // compact_count stores 16 bits per pixel and carries into a sparse spill
+  // table. Filtered histograms (see density_filter.hpp) use double, since
+  // filtering spreads hits fractionally between pixels.
+
+  class checked_count {
+  public:
+    static constexpr uint64_t max = std::numeric_limits<uint64_t>::max();
+
+    checked_count(uint64_t value = 0) : value_(value) {}
+
+    inline operator uint64_t() const {
+      return value_;
+    }
+
+    inline checked_count & operator ++() {
+      if(value_ == max)
+        throw std::overflow_error("hit count overflowed");
+      ++value_;
+      return *this;
+    }
+
+    inline checked_count operator ++(int) {
+      auto old = *this;
+      ++*this;
+      return old;
+    }
+
+    inline checked_count & operator +=(uint64_t n) {
+      if(max - value_ < n)
+        throw std::overflow_error("hit count overflowed");
+      value_ += n;
+      return *this;
+    }
+  private:
+    uint64_t value_;
+  };
+
+  // A tag selecting compact_plane as the alpha plane.
+  struct compact_count {};
+
+  // A plane of 16-bit counters. When a counter wraps, the carry goes into a
+  // 32-bit high half, which is only allocated for the blocks of pixels that
+  // need it; for a typical flame that's the small, dense core. Different
+  // threads may update different pixels at once, as with an ordinary plane.
+  class compact_plane {
+  public:
+    static constexpr uint64_t max = (uint64_t(1) << 48) - 1;
+
+    static constexpr size_t block_bits = 12;
+    static constexpr size_t block_size = size_t(1) << block_bits;
+    static constexpr size_t block_mask = block_size - 1;
+
+    // Reads and updates individual counters. This only refers to the plane,
+    // so it's cheap to copy; it must not outlive the plane.
+    class accessor {
+    public:
+      accessor() = default;
+      accessor(uint16_t *low, std::atomic<uint32_t*> *high)
+        : low_(low), high_(high) {}
+
+      inline uint64_t get(size_t i) const {
+        uint32_t *high = high_[i >> block_bits].load(std::memory_order_acquire);
+        return low_[i] + (high ? uint64_t(high[i & block_mask]) << 16 : 0);
+      }
+
+      inline void set(size_t i, uint64_t value) const {
+        if(value > max)
+          throw std::overflow_error("hit count overflowed");
+        low_[i] = static_cast<uint16_t>(value);
+        uint32_t hi = static_cast<uint32_t>(value >> 16);
+        uint32_t *high = high_[i >> block_bits].load(std::memory_order_acquire);
+        if(hi && !high)
+          high = allocate(i);
+        if(high)
+          high[i & block_mask] = hi;
+      }
+
+      inline void increment(size_t i) const {
+        if(++low_[i] == 0)
+          carry(i);
+      }
+    private:
+      void carry(size_t i) const {
+        uint32_t *high = high_[i >> block_bits].load(std::memory_order_acquire);
+        if(!high)
+          high = allocate(i);
+        if(high[i & block_mask] == std::numeric_limits<uint32_t>::max())
+          throw std::overflow_error("hit count overflowed");
+        high[i & block_mask]++;
+      }
+
+      // Two threads may race to allocate the same block (for different
+      // pixels), so the loser frees its copy and uses the winner's.
+      uint32_t * allocate(size_t i) const {
+        auto &slot = high_[i >> block_bits];
+        uint32_t *block = new uint32_t[block_size]();
+        uint32_t *expected = nullptr;
+        if(!slot.compare_exchange_strong(expected, block,
+                                         std::memory_order_acq_rel)) {
+          delete[] block;
+          return expected;
+        }
+        return block;
+      }
+
+      uint16_t *low_ = nullptr;
+      std::atomic<uint32_t*> *high_ = nullptr;
+    };
+
+    // A proxy for one counter, so that views can be used like GIL views of
+    // plain integers.
+    class reference {
+    public:
+      reference(const accessor &counts, size_t i) : counts_(counts), i_(i) {}
+
+      inline operator uint64_t() const {
+        return counts_.get(i_);
+      }
+
+      inline reference & operator =(uint64_t value) {
+        counts_.set(i_, value);
+        return *this;
+      }
+
+      inline reference & operator +=(uint64_t n) {
+        return *this = counts_.get(i_) + n;
+      }
+
+      inline reference & operator ++() {
+        counts_.increment(i_);
+        return *this;
+      }
+
+      inline uint64_t operator ++(int) {
+        uint64_t old = *this;
+        counts_.increment(i_);
+        return old;
+      }
+    private:
+      accessor counts_;
+      size_t i_;
+    };
+
+    class row {
+    public:
+      row(const accessor &counts, size_t begin)
+        : counts_(counts), begin_(begin) {}
+
+      inline reference operator [](ptrdiff_t x) const {
+        return {counts_, begin_ + x};
+      }
+    private:
+      accessor counts_;
+      size_t begin_;
+    };
+
+    class view_type {
+    public:
+      view_type() = default;
+      view_type(const accessor &counts,
+                const boost::gil::point2<ptrdiff_t> &dims)
+        : counts_(counts), dims_(dims) {}
+
+      inline boost::gil::point2<ptrdiff_t> dimensions() const {
+        return dims_;
+      }
+
+      inline ptrdiff_t width() const {
+        return dims_.x;
+      }
+
+      inline ptrdiff_t height() const {
+        return dims_.y;
+      }
+
+      inline size_t size() const {
+        return dims_.x * dims_.y;
+      }
+
+      inline reference operator [](size_t i) const {
+        return {counts_, i};
+      }
+
+      inline row row_begin(ptrdiff_t y) const {
+        return {counts_, static_cast<size_t>(y * dims_.x)};
+      }
+    private:
+      accessor counts_;
+      boost::gil::point2<ptrdiff_t> dims_;
+    };
+
+    using const_view_type = view_type;
+
+    compact_plane(const boost::gil::point2<ptrdiff_t> &dims)
+      : dims_(dims), low_(new uint16_t[size()]()),
+        high_(new std::atomic<uint32_t*>[blocks()]) {
+      for(size_t b = 0; b != blocks(); b++)
+        high_[b] = nullptr;
+    }
+
+    compact_plane(const compact_plane &rhs) : compact_plane(rhs.dims_) {
+      std::memcpy(low_.get(), rhs.low_.get(), size() * sizeof(uint16_t));
+      for(size_t b = 0; b != blocks(); b++) {
+        if(uint32_t *src = rhs.high_[b].load()) {
+          uint32_t *dst = new uint32_t[block_size];
+          std::memcpy(dst, src, block_size * sizeof(uint32_t));
+          high_[b] = dst;
+        }
+      }
+    }
+
+    compact_plane(compact_plane &&rhs) = default;
+
+    compact_plane & operator =(compact_plane rhs) {
+      std::swap(dims_, rhs.dims_);
+      std::swap(low_, rhs.low_);
+      std::swap(high_, rhs.high_);
+      return *this;
+    }
+
+    ~compact_plane() {
+      if(high_) {
+        for(size_t b = 0; b != blocks(); b++)
+          delete[] high_[b].load();
+      }
+    }
+
+    inline boost::gil::point2<ptrdiff_t> dimensions() const {
+      return dims_;
+    }
+
+    inline view_type view() {
+      return {{low_.get(), high_.get()}, dims_};
+    }
+
+    // Views don't distinguish constness; don't write through this one.
+    inline const_view_type const_view() const {
+      return {{low_.get(), high_.get()}, dims_};
+    }
+  private:
+
+    inline size_t size() const {
+      return dims_.x * dims_.y;
+    }
+
+    inline size_t blocks() const {
+      return (size() + block_size - 1) >> block_bits;
+    }
+
+    boost::gil::point2<ptrdiff_t> dims_;
+    std::unique_ptr<uint16_t[]> low_;
+    std::unique_ptr<std::atomic<uint32_t*>[]> high_;
+  };
+
+  namespace detail {
+    template<typename Counter>
+    constexpr uint64_t counter_max() {
+      if constexpr(std::is_floating_point_v<Counter>)
+        return std::numeric_limits<uint64_t>::max();
+      else
+        return std::numeric_limits<Counter>::max();
+    }
+  }
+
+  // The storage and views for each kind of counter.
+  template<typename Counter>
+  struct alpha_plane {
+    using image = boost::gil::image<Counter, false>;
+    using view = typename image::view_t;
+    using const_view = typename image::const_view_t;
+    static constexpr uint64_t max = detail::counter_max<Counter>();
+
+    static image make(const boost::gil::point2<ptrdiff_t> &dims) {
+      return image(dims, Counter(0), 0);
+    }
+
+    static view make_view(image &i) {
+      return boost::gil::view(i);
+    }
+
+    static const_view make_const_view(const image &i) {
+      return boost::gil::const_view(i);
+    }
+  };
+
+  template<>
+  struct alpha_plane<checked_count> {
+    using image = boost::gil::image<checked_count, false>;
+    using view = typename image::view_t;
+    using const_view = typename image::const_view_t;
+    static constexpr uint64_t max = checked_count::max;
+
+    static image make(const boost::gil::point2<ptrdiff_t> &dims) {
+      return image(dims, checked_count(0), 0);
+    }
+
+    static view make_view(image &i) {
+      return boost::gil::view(i);
+    }
+
+    static const_view make_const_view(const image &i) {
+      return boost::gil::const_view(i);
+    }
+  };
+
+  template<>
+  struct alpha_plane<compact_count> {
+    using image = compact_plane;
+    using view = compact_plane::view_type;
+    using const_view = compact_plane::const_view_type;
+    static constexpr uint64_t max = compact_plane::max;
+
+    static image make(const boost::gil::point2<ptrdiff_t> &dims) {
+      return image(dims);
+    }
+
+    static view make_view(image &i) {
+      return i.view();
+    }
+
+    static const_view make_const_view(const image &i) {
+      return i.const_view();
+    }
+  };
+
+} // namespace images
+
+#endif
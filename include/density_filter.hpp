@@ -0,0 +1,299 @@
+#ifndef INC_MUSPELHEIM_DENSITY_FILTER_HPP
+#define INC_MUSPELHEIM_DENSITY_FILTER_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "images.hpp"
+#include "thread_pool.hpp"
+
+namespace images {
+
+  // How to filter a histogram down to an image. The histogram is rendered
+  // at `oversample` times the image's size in each dimension and
+  // downsampled with a tent filter, which antialiases edges and averages
+  // away some of the noise of sparse pixels.
+  //
+  // If `de_max_radius` is positive, the histogram is first blurred by
+  // density estimation: a pixel with n hits is spread over a Gaussian of
+  // radius max(de_max_radius / n^de_curve, de_min_radius), measured in image
+  // pixels. Sparse regions are smoothed heavily while dense, well-sampled
+  // ones stay sharp, which gives a clean image with far fewer iterations.
+  struct filter_options {
+    size_t oversample = 1;
+    double de_max_radius = 0;
+    double de_min_radius = 0;
+    double de_curve = 0.4;
+
+    inline bool trivial() const {
+      return oversample == 1 && de_max_radius <= 0;
+    }
+  };
+
+  namespace detail {
+    template<typename Counter>
+    inline double count_at(const typename alpha_plane<Counter>::view &alpha,
+                           ptrdiff_t x, ptrdiff_t y) {
+      return static_cast<count_type<Counter>>(alpha.row_begin(y)[x]);
+    }
+
+    // A normalized Gaussian with standard deviation radius / 2, truncated
+    // at `radius`: element i is the weight for a pixel i away.
+    inline std::vector<double> gaussian_kernel(double radius) {
+      std::vector<double> taps(static_cast<size_t>(radius) + 1);
+      const double scale = 2 / (radius * radius);
+      double sum = 0;
+      for(size_t i = 0; i != taps.size(); i++) {
+        taps[i] = std::exp(-scale * i * i);
+        sum += i ? 2 * taps[i] : taps[i];
+      }
+      for(auto &t : taps)
+        t /= sum;
+      return taps;
+    }
+
+    // The density estimation kernels, one per radius class. Radii are
+    // quantized geometrically (four classes per octave) so that each
+    // class can be blurred with one precomputed separable kernel; radii
+    // below one pixel wouldn't blur at all and are left unfiltered.
+    class de_kernels {
+    public:
+      static constexpr uint8_t unfiltered = 0xff;
+      static constexpr double steps_per_octave = 4;
+
+      de_kernels(double max_radius, double min_radius, double curve)
+        : max_radius_(max_radius), min_radius_(min_radius), curve_(curve) {
+        for(double r = max_radius; r >= 1 && taps_.size() != unfiltered;
+            r = max_radius * std::exp2(-(taps_.size() / steps_per_octave)))
+          taps_.push_back(gaussian_kernel(r));
+      }
+
+      inline size_t size() const {
+        return taps_.size();
+      }
+
+      inline const std::vector<double> & operator [](size_t i) const {
+        return taps_[i];
+      }
+
+      // The class of the kernel for a pixel with `n` hits.
+      uint8_t classify(double n) const {
+        double r = std::max(max_radius_ * std::pow(n, -curve_), min_radius_);
+        if(r < 1)
+          return unfiltered;
+        double k = std::round(steps_per_octave * std::log2(max_radius_ / r));
+        return static_cast<uint8_t>(
+          std::clamp(k, 0.0, static_cast<double>(taps_.size() - 1))
+        );
+      }
+    private:
+      double max_radius_, min_radius_, curve_;
+      std::vector<std::vector<double>> taps_;
+    };
+
+    // Blur every pixel of `src` by its density estimation kernel. Each
+    // class of kernel gets a horizontal pass, spreading that class's pixels
+    // along their rows, and a vertical pass spreading the result along the
+    // columns into the output. The horizontal passes are split across
+    // `pool` by rows and the vertical ones by blocks of columns, so no two
+    // threads write the same pixel and the sums don't depend on the
+    // number of threads.
+    template<typename Counter>
+    raw_image_data<double>
+    estimate_density(const raw_image_view<Counter> &src,
+                     const de_kernels &kernels,
+                     parallel::thread_pool *pool) {
+      const auto dims = src.dimensions();
+      const ptrdiff_t width = dims.x, height = dims.y;
+      raw_image_data<double> dst(dims), tmp(dims);
+      auto dst_view = dst.view(), tmp_view = tmp.view();
+
+      std::vector<uint8_t> classes(width * height);
+      parallel::for_each_block(pool, height, 16, [&](
+        size_t begin, size_t end
+      ) {
+        for(size_t y = begin; y != end; y++) {
+          auto c = src.color.row_begin(y);
+          auto dc = dst_view.color.row_begin(y);
+          auto da = dst_view.alpha.row_begin(y);
+          auto k = classes.begin() + y * width;
+          for(ptrdiff_t x = 0; x != width; x++) {
+            double n = count_at<Counter>(src.alpha, x, y);
+            k[x] = n ? kernels.classify(n) : de_kernels::unfiltered;
+            if(n && k[x] == de_kernels::unfiltered) {
+              dc[x] = c[x];
+              da[x] = n;
+            }
+          }
+        }
+      });
+
+      // Rows of `tmp` that the current class left anything in.
+      std::vector<char> used(height, false);
+      for(size_t k = 0; k != kernels.size(); k++) {
+        const auto &taps = kernels[k];
+        const ptrdiff_t radius = taps.size() - 1;
+
+        parallel::for_each_block(pool, height, 16, [&](
+          size_t begin, size_t end
+        ) {
+          for(size_t y = begin; y != end; y++) {
+            auto c = src.color.row_begin(y);
+            auto tc = tmp_view.color.row_begin(y);
+            auto ta = tmp_view.alpha.row_begin(y);
+            if(used[y]) {
+              std::fill(tc, tc + width, 0.0);
+              std::fill(ta, ta + width, 0.0);
+            }
+
+            bool any = false;
+            auto row_classes = classes.begin() + y * width;
+            for(ptrdiff_t x = 0; x != width; x++) {
+              if(row_classes[x] != k)
+                continue;
+              any = true;
+              double color = c[x], n = count_at<Counter>(src.alpha, x, y);
+              ptrdiff_t lo = std::max<ptrdiff_t>(x - radius, 0);
+              ptrdiff_t hi = std::min<ptrdiff_t>(x + radius, width - 1);
+              for(ptrdiff_t i = lo; i <= hi; i++) {
+                double w = taps[std::abs(i - x)];
+                tc[i] += w * color;
+                ta[i] += w * n;
+              }
+            }
+            used[y] = any;
+          }
+        });
+
+        parallel::for_each_block(pool, width, 64, [&](
+          size_t begin, size_t end
+        ) {
+          for(ptrdiff_t y = 0; y != height; y++) {
+            if(!used[y])
+              continue;
+            auto tc = tmp_view.color.row_begin(y);
+            auto ta = tmp_view.alpha.row_begin(y);
+            ptrdiff_t lo = std::max<ptrdiff_t>(y - radius, 0);
+            ptrdiff_t hi = std::min<ptrdiff_t>(y + radius, height - 1);
+            for(ptrdiff_t j = lo; j <= hi; j++) {
+              double w = taps[std::abs(j - y)];
+              auto dc = dst_view.color.row_begin(j);
+              auto da = dst_view.alpha.row_begin(j);
+              for(size_t x = begin; x != end; x++) {
+                dc[x] += w * tc[x];
+                da[x] += w * ta[x];
+              }
+            }
+          }
+        });
+      }
+
+      return dst;
+    }
+
+    // The weights of a tent filter that downsamples by `factor`: output
+    // pixel X gathers input pixel X * factor + offsets[i] with weights[i].
+    // The weights for each output sum to `factor` and each input's
+    // contributions sum to one, so the total number of hits is unchanged.
+    struct tent_filter {
+      explicit tent_filter(ptrdiff_t factor) {
+        for(ptrdiff_t o = -factor; o < 2 * factor; o++) {
+          double w = 1 - std::abs(o + 0.5 - 0.5 * factor) / factor;
+          if(w > 0) {
+            offsets.push_back(o);
+            weights.push_back(w);
+          }
+        }
+      }
+
+      std::vector<ptrdiff_t> offsets;
+      std::vector<double> weights;
+    };
+
+    // Downsample `src` by `factor` in each dimension: rows first, split
+    // across `pool`, then columns, split across `pool` by output row.
+    template<typename Counter>
+    raw_image_data<double>
+    downsample(const raw_image_view<Counter> &src, ptrdiff_t factor,
+               parallel::thread_pool *pool) {
+      using dims_t = boost::gil::point2<ptrdiff_t>;
+      const auto src_dims = src.dimensions();
+      assert(src_dims.x % factor == 0 && src_dims.y % factor == 0);
+      const ptrdiff_t width = src_dims.x / factor, height = src_dims.y / factor;
+      const tent_filter tent(factor);
+
+      raw_image_data<double> tmp(dims_t(width, src_dims.y));
+      auto tmp_view = tmp.view();
+      parallel::for_each_block(pool, src_dims.y, 16, [&](
+        size_t begin, size_t end
+      ) {
+        for(size_t y = begin; y != end; y++) {
+          auto c = src.color.row_begin(y);
+          auto tc = tmp_view.color.row_begin(y);
+          auto ta = tmp_view.alpha.row_begin(y);
+          for(ptrdiff_t x = 0; x != width; x++) {
+            for(size_t i = 0; i != tent.offsets.size(); i++) {
+              ptrdiff_t sx = x * factor + tent.offsets[i];
+              if(sx < 0 || sx >= src_dims.x)
+                continue;
+              tc[x] += tent.weights[i] * c[sx];
+              ta[x] += tent.weights[i] * count_at<Counter>(src.alpha, sx, y);
+            }
+          }
+        }
+      });
+
+      raw_image_data<double> dst(dims_t(width, height));
+      auto dst_view = dst.view();
+      parallel::for_each_block(pool, height, 16, [&](
+        size_t begin, size_t end
+      ) {
+        for(size_t y = begin; y != end; y++) {
+          auto dc = dst_view.color.row_begin(y);
+          auto da = dst_view.alpha.row_begin(y);
+          for(size_t i = 0; i != tent.offsets.size(); i++) {
+            ptrdiff_t sy = static_cast<ptrdiff_t>(y) * factor + tent.offsets[i];
+            if(sy < 0 || sy >= src_dims.y)
+              continue;
+            double w = tent.weights[i];
+            auto tc = tmp_view.color.row_begin(sy);
+            auto ta = tmp_view.alpha.row_begin(sy);
+            for(ptrdiff_t x = 0; x != width; x++) {
+              dc[x] += w * tc[x];
+              da[x] += w * ta[x];
+            }
+          }
+        }
+      });
+
+      return dst;
+    }
+  }
+
+  // Filter a histogram rendered at `opts.oversample` times the image size
+  // into an image-sized histogram of fractional hit counts, ready for
+  // tone_mapper. Radii in `opts` are in image pixels.
+  template<typename Counter>
+  raw_image_data<double>
+  filter_histogram(const raw_image_view<Counter> &src,
+                   const filter_options &opts,
+                   parallel::thread_pool *pool = nullptr) {
+    assert(opts.oversample > 0);
+    const double scale = opts.oversample;
+    if(opts.de_max_radius * scale >= 1) {
+      detail::de_kernels kernels(opts.de_max_radius * scale,
+                                 opts.de_min_radius * scale, opts.de_curve);
+      auto estimated = detail::estimate_density(src, kernels, pool);
+      if(opts.oversample == 1)
+        return estimated;
+      return detail::downsample(estimated.view(), opts.oversample, pool);
+    }
+    return detail::downsample(src, opts.oversample, pool);
+  }
+
+} // namespace images
+
+#endif
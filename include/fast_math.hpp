@@ -0,0 +1,106 @@
+#ifndef INC_MUSPELHEIM_FAST_MATH_HPP
+#define INC_MUSPELHEIM_FAST_MATH_HPP
+
+#include <cmath>
+
+namespace math::fast {
+
+  // Polynomial approximations of the transcendental functions the variations
+  // use. They trade the last few digits for speed: sin and cos are within
+  // 3e-11 of std::sin and std::cos for |x| < 2^20. Larger arguments lose
+  // accuracy during range reduction, but stay in [-1, 1].
+  //
+  // None of these branch on their data, so loops over them can be
+  // vectorized (though GCC only if-converts the comparisons below with
+  // -fno-trapping-math).
+
+  namespace detail {
+    constexpr double inv_pi = 0.3183098861837907;
+
+    // pi split in two, so that k * pi_hi is exact for |k| < 2^21.
+    constexpr double pi_hi = 3.1415926534682512;
+    constexpr double pi_lo = 1.2154201013012384e-10;
+
+    // Round to the nearest integer (ties to even), for |x| < 2^51.
+    inline double round(double x) {
+      const double shift = 0x1.8p52;
+      return (x + shift) - shift;
+    }
+
+    // x - k*pi, where `k` is a whole or half integer chosen to bring the
+    // result into [-pi/2, pi/2]. Arguments that are too big to reduce are
+    // clamped, so that the results below are at least in range.
+    inline double reduce(double x, double k) {
+      const double pi_2 = 1.5707963267948966;
+      double r = (x - k * pi_hi) - k * pi_lo;
+      r = r < -pi_2 ? -pi_2 : r;
+      return r > pi_2 ? pi_2 : r;
+    }
+
+    // (-1)^n. This is arithmetic rather than a branch, since the parity is
+    // as good as random.
+    inline double sign(double n) {
+      double parity = n - 2 * round(n * 0.5);
+      return 1 - 2 * parity * parity;
+    }
+
+    // sin(r) and cos(r) for |r| <= pi/2. The coefficients are fitted at
+    // Chebyshev nodes, so the error is nearly even across the range.
+    inline double sin_poly(double r) {
+      double z = r * r;
+      return r * (0.9999999999829192 + z * (-0.16666666616815623 +
+                  z * (0.008333330974208197 + z * (-0.0001984086117931327 +
+                  z * (2.7525269809674547e-06 + z * -2.388921770354657e-08)))));
+    }
+
+    inline double cos_poly(double r) {
+      double z = r * r;
+      return 0.9999999999992479 + z * (-0.4999999999701273 +
+             z * (0.04166666647285232 + z * (-0.0013888884170810672 +
+             z * (2.480103993035509e-05 + z * (-2.752467052822841e-07 +
+             z * 1.990750770878805e-09)))));
+    }
+  }
+
+  inline double sin(double x) {
+    double k = detail::round(x * detail::inv_pi);
+    return detail::sign(k) * detail::sin_poly(detail::reduce(x, k));
+  }
+
+  // cos(x) = sin(x + pi/2), but reducing by a half-integer multiple of pi
+  // rather than adding pi/2 to `x` and losing its low bits.
+  inline double cos(double x) {
+    double k = detail::round(x * detail::inv_pi + 0.5);
+    return detail::sign(k) * detail::sin_poly(detail::reduce(x, k - 0.5));
+  }
+
+  // Compute sin(x) and cos(x) together, sharing the range reduction.
+  inline void sincos(double x, double &s, double &c) {
+    double k = detail::round(x * detail::inv_pi);
+    double r = detail::reduce(x, k), sign = detail::sign(k);
+    s = sign * detail::sin_poly(r);
+    c = sign * detail::cos_poly(r);
+  }
+
+  // Single-precision versions, evaluated in double. The conversions are
+  // cheap next to the polynomials, and there's only one set of coefficients
+  // to get right.
+
+  inline float sin(float x) {
+    return static_cast<float>(sin(static_cast<double>(x)));
+  }
+
+  inline float cos(float x) {
+    return static_cast<float>(cos(static_cast<double>(x)));
+  }
+
+  inline void sincos(float x, float &s, float &c) {
+    double ds, dc;
+    sincos(static_cast<double>(x), ds, dc);
+    s = static_cast<float>(ds);
+    c = static_cast<float>(dc);
+  }
+
+} // namespace math::fast
+
+#endif
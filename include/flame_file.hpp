@@ -0,0 +1,316 @@
+#ifndef INC_MUSPELHEIM_FLAME_FILE_HPP
+#define INC_MUSPELHEIM_FLAME_FILE_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/gil/pixel.hpp>
+
+#include "ifs.hpp"
+#include "symmetry.hpp"
+#include "variations.hpp"
+
+namespace ifs {
+
+  // Flame files describe a function system in plain text, so that flames
+  // can be rendered without compiling them in. Each line is a keyword and
+  // its arguments; everything after a '#' is a comment, and indentation is
+  // just for show:
+  //
+  //   function                 # starts a new function
+  //     transform A B C D E F  # x' = Ax + By + C, y' = Dx + Ey + F
+  //                            # (default: the identity)
+  //     variation NAME WEIGHT  # repeatable (default: linear 1)
+  //     post A B C D E F       # (default: the identity)
+  //     color R G B            # required; 0 to 255 for 8-bit channels
+  //     weight W               # (default: 1)
+  //     color-index I          # (default: spread evenly)
+  //   xaos                     # optional; followed by one row of
+  //     1 0 1                  # weights per function
+  //   symmetry SYM             # optional; none, N or dN
+  //   camera X Y ZOOM ROTATION # optional; see camera.hpp
+  //
+  // Only the built-in variations can be named, so flames with custom
+  // variations have to stay in C++.
+
+  namespace detail {
+    inline constexpr std::pair<const char *, math::variation_type>
+    variation_names[] = {
+      {"linear", math::variation_type::linear},
+      {"sinusoidal", math::variation_type::sinusoidal},
+      {"spherical", math::variation_type::spherical},
+      {"swirl", math::variation_type::swirl},
+      {"handkerchief", math::variation_type::handkerchief},
+      {"spiral", math::variation_type::spiral},
+    };
+
+    class flame_parser {
+    public:
+      flame_parser(std::istream &in, const std::string &name)
+        : in_(in), name_(name) {}
+
+      // Read the next non-blank line into words; false at the end.
+      bool next() {
+        std::string line;
+        while(std::getline(in_, line)) {
+          line_no_++;
+          line = line.substr(0, line.find('#'));
+          std::istringstream ss(line);
+          words_.clear();
+          for(std::string word; ss >> word;)
+            words_.push_back(word);
+          if(!words_.empty())
+            return true;
+        }
+        return false;
+      }
+
+      const std::vector<std::string> & words() const {
+        return words_;
+      }
+
+      double number(size_t i) const {
+        const std::string &word = words_[i];
+        char *end;
+        double value = std::strtod(word.c_str(), &end);
+        if(word.empty() || *end != '\0')
+          error("expected a number, got '" + word + "'");
+        return value;
+      }
+
+      std::vector<double> numbers(size_t first = 1) const {
+        std::vector<double> values;
+        for(size_t i = first; i != words_.size(); i++)
+          values.push_back(number(i));
+        return values;
+      }
+
+      void expect_args(size_t n) const {
+        if(words_.size() != n + 1) {
+          error("'" + words_[0] + "' takes " + std::to_string(n) +
+                " argument" + (n == 1 ? "" : "s"));
+        }
+      }
+
+      [[noreturn]] void error(const std::string &message) const {
+        throw std::runtime_error(name_ + ":" + std::to_string(line_no_) +
+                                 ": " + message);
+      }
+    private:
+      std::istream &in_;
+      std::string name_;
+      size_t line_no_ = 0;
+      std::vector<std::string> words_;
+    };
+
+    inline math::affine_transform
+    parse_affine(const flame_parser &parser) {
+      parser.expect_args(6);
+      auto v = parser.numbers();
+      return {v[0], v[1], v[2], v[3], v[4], v[5]};
+    }
+
+    inline void write_affine(std::ostream &out, const char *keyword,
+                             const math::affine_transform &t) {
+      out << "  " << keyword;
+      for(double v : {t.a, t.b, t.c, t.d, t.e, t.f})
+        out << " " << v;
+      out << "\n";
+    }
+  }
+
+  // Read a flame file from `in`; `name` is used in error messages.
+  template<typename Pixel>
+  iterated_function_system<Pixel>
+  read_flame(std::istream &in, const std::string &name = "<flame>") {
+    using function_t = iterated_function<Pixel>;
+    using channel_t = typename boost::gil::channel_type<Pixel>::type;
+    using boost::gil::channel_traits;
+    constexpr size_t channels = boost::gil::size<Pixel>::value;
+
+    // The pieces of the function being read.
+    struct pending {
+      std::vector<typename function_t::value_type> variations;
+      math::affine_transform transform = math::identity();
+      math::affine_transform post = math::identity();
+      std::optional<Pixel> color;
+      double weight = 1;
+      std::optional<double> color_index;
+    };
+
+    detail::flame_parser parser(in, name);
+    std::vector<function_t> funcs;
+    std::optional<pending> func;
+    typename iterated_function_system<Pixel>::xaos_matrix xaos;
+    ifs::symmetry sym;
+    ifs::camera cam;
+    bool in_xaos = false;
+
+    auto finish = [&]() {
+      if(!func)
+        return;
+      if(!func->color)
+        parser.error("function has no color");
+      if(func->variations.empty())
+        func->variations.push_back({math::variation_type::linear, 1});
+      funcs.emplace_back(std::move(func->variations), func->transform,
+                         *func->color, func->post, func->weight,
+                         func->color_index);
+      func.reset();
+    };
+
+    while(parser.next()) {
+      const auto &words = parser.words();
+      const std::string &keyword = words[0];
+
+      if(keyword == "function") {
+        parser.expect_args(0);
+        finish();
+        func.emplace();
+        in_xaos = false;
+      } else if(keyword == "xaos") {
+        parser.expect_args(0);
+        finish();
+        in_xaos = true;
+      } else if(keyword == "symmetry") {
+        parser.expect_args(1);
+        finish();
+        in_xaos = false;
+        auto parsed = parse_symmetry(words[1]);
+        if(!parsed)
+          parser.error("unknown symmetry '" + words[1] + "'");
+        sym = *parsed;
+      } else if(keyword == "camera") {
+        parser.expect_args(4);
+        finish();
+        in_xaos = false;
+        auto v = parser.numbers();
+        if(!(v[2] > 0))
+          parser.error("camera zoom must be positive");
+        cam = {{v[0], v[1]}, v[2], v[3]};
+      } else if(in_xaos) {
+        xaos.push_back(parser.numbers(0));
+      } else if(!func) {
+        parser.error("'" + keyword + "' outside of a function");
+      } else if(keyword == "transform") {
+        func->transform = detail::parse_affine(parser);
+      } else if(keyword == "post") {
+        func->post = detail::parse_affine(parser);
+      } else if(keyword == "variation") {
+        parser.expect_args(2);
+        auto found = std::find_if(
+          std::begin(detail::variation_names),
+          std::end(detail::variation_names),
+          [&](const auto &i) { return words[1] == i.first; }
+        );
+        if(found == std::end(detail::variation_names))
+          parser.error("unknown variation '" + words[1] + "'");
+        func->variations.push_back({found->second, parser.number(2)});
+      } else if(keyword == "color") {
+        parser.expect_args(channels);
+        auto v = parser.numbers();
+        const double min = channel_traits<channel_t>::min_value();
+        const double max = channel_traits<channel_t>::max_value();
+        Pixel color;
+        for(size_t chan = 0; chan != channels; chan++) {
+          if(!(v[chan] >= min && v[chan] <= max)) {
+            std::ostringstream message;
+            message << "color channels must be between " << min << " and "
+                    << max;
+            parser.error(message.str());
+          }
+          color[chan] = static_cast<channel_t>(v[chan]);
+        }
+        func->color = color;
+      } else if(keyword == "weight") {
+        parser.expect_args(1);
+        func->weight = parser.number(1);
+      } else if(keyword == "color-index") {
+        parser.expect_args(1);
+        func->color_index = parser.number(1);
+      } else {
+        parser.error("unknown keyword '" + keyword + "'");
+      }
+    }
+    finish();
+
+    if(funcs.empty())
+      parser.error("no functions");
+    try {
+      iterated_function_system<Pixel> result(std::move(funcs),
+                                             std::move(xaos), sym);
+      result.set_camera(cam);
+      return result;
+    } catch(const std::invalid_argument &e) {
+      parser.error(e.what());
+    }
+  }
+
+  template<typename Pixel>
+  iterated_function_system<Pixel> load_flame(const std::string &filename) {
+    std::ifstream in(filename);
+    if(!in)
+      throw std::runtime_error("unable to open " + filename);
+    return read_flame<Pixel>(in, filename);
+  }
+
+  // Write `funcs` as a flame file. Numbers are written with enough digits to
+  // read back exactly, so the result has the same hash() as `funcs`.
+  template<typename Pixel>
+  void write_flame(std::ostream &out,
+                   const iterated_function_system<Pixel> &funcs) {
+    auto flags = out.flags();
+    auto precision = out.precision(17);
+    for(const auto &f : funcs) {
+      out << "function\n";
+      detail::write_affine(out, "transform", f.transform());
+      for(const auto &[v, weight] : f.variations()) {
+        auto found = std::find_if(
+          std::begin(detail::variation_names),
+          std::end(detail::variation_names),
+          [&](const auto &i) { return v.type() == i.second; }
+        );
+        if(found == std::end(detail::variation_names))
+          throw std::invalid_argument("custom variations can't be written");
+        out << "  variation " << found->first << " " << weight << "\n";
+      }
+      detail::write_affine(out, "post", f.post());
+      out << "  color";
+      for(size_t chan = 0; chan != boost::gil::size<Pixel>::value; chan++)
+        out << " " << +f.color()[chan];
+      out << "\n  weight " << f.weight() << "\n"
+          << "  color-index " << f.color_index() << "\n";
+    }
+    if(!funcs.xaos().empty()) {
+      out << "xaos\n";
+      for(const auto &row : funcs.xaos()) {
+        out << " ";
+        for(double v : row)
+          out << " " << v;
+        out << "\n";
+      }
+    }
+    if(!funcs.symmetry().trivial())
+      out << "symmetry " << to_string(funcs.symmetry()) << "\n";
+    if(funcs.camera() != ifs::camera{}) {
+      const auto &cam = funcs.camera();
+      out << "camera " << cam.center.x << " " << cam.center.y << " "
+          << cam.zoom << " " << cam.rotation << "\n";
+    }
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+} // namespace ifs
+
+#endif
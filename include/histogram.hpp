@@ -0,0 +1,244 @@
+#ifndef INC_MUSPELHEIM_HISTOGRAM_HPP
+#define INC_MUSPELHEIM_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "images.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace images {
+
+  // Record one hit with color index `c` at linear pixel index `i`. Once a
+  // plain integer count reaches its maximum, further hits on that pixel are
+  // dropped, so it keeps its average color instead of wrapping around to
+  // (almost) nothing. (checked_count and compact_count handle overflow
+  // themselves.)
+  template<typename ColorView, typename AlphaView>
+  inline void plot(const ColorView &color, const AlphaView &alpha, size_t i,
+                   double c) {
+    using count_t = std::remove_reference_t<decltype(alpha[i])>;
+    if constexpr(std::is_integral_v<count_t>) {
+      if(alpha[i] == std::numeric_limits<count_t>::max())
+        return;
+    }
+    color[i] += c;
+    alpha[i]++;
+  }
+
+  // A single histogram written to by many threads at once, with hit counts
+  // of type `Counter` (see counters.hpp). The rows are split into bands,
+  // each with its own lock, so threads only contend when they flush hits
+  // into the same band at the same time.
+  template<typename Counter = uint32_t>
+  class shared_image_data {
+  public:
+    using counter_type = Counter;
+    using image_data = raw_image_data<Counter>;
+    using image_view = raw_image_view<Counter>;
+
+    // Allocate a new, empty histogram.
+    explicit shared_image_data(
+      const boost::gil::point2<ptrdiff_t> &dimensions,
+      ptrdiff_t max_bands = 256
+    ) : storage_(std::make_unique<image_data>(dimensions)),
+        view_(storage_->view()),
+        band_rows_(band_rows(dimensions, max_bands)),
+        locks_((dimensions.y + band_rows_ - 1) / band_rows_),
+        canvas_(dimensions) {}
+
+    // Accumulate into existing planes owned by someone else. Anything
+    // already in them is kept.
+    explicit shared_image_data(const image_view &view,
+                               ptrdiff_t max_bands = 256)
+      : view_(view),
+        band_rows_(band_rows(view.dimensions(), max_bands)),
+        locks_((view.dimensions().y + band_rows_ - 1) / band_rows_),
+        canvas_(view.dimensions()) {}
+
+    shared_image_data(const shared_image_data &) = delete;
+    shared_image_data & operator =(const shared_image_data &) = delete;
+
+    auto dimensions() const {
+      return view_.dimensions();
+    }
+
+    // A histogram normally covers a whole canvas. To render a canvas in
+    // tiles, each with its own histogram, give every tile its place: it
+    // holds the pixels from `origin` on of a canvas of `canvas` pixels.
+    void set_canvas(const boost::gil::point2<ptrdiff_t> &canvas,
+                    const boost::gil::point2<ptrdiff_t> &origin) {
+      canvas_ = canvas;
+      origin_ = origin;
+    }
+
+    inline const boost::gil::point2<ptrdiff_t> & canvas_dimensions() const {
+      return canvas_;
+    }
+
+    inline const boost::gil::point2<ptrdiff_t> & origin() const {
+      return origin_;
+    }
+
+    inline size_t bands() const {
+      return locks_.size();
+    }
+
+    inline size_t band(const boost::gil::point2<ptrdiff_t> &pt) const {
+      return static_cast<size_t>(pt.y / band_rows_);
+    }
+
+    inline std::mutex & lock(size_t band) {
+      return locks_[band];
+    }
+
+    // The number of slots that index() can return.
+    inline size_t capacity() const {
+      return view_.color.size();
+    }
+
+    // Where the hits for `pt` are accumulated; pass this to plot().
+    inline size_t index(const boost::gil::point2<ptrdiff_t> &pt) const {
+      return pt.y * dimensions().x + pt.x;
+    }
+
+    // Record one hit at `index`. Only safe while holding the relevant band's
+    // lock (or otherwise being the only writer to that band).
+    inline void plot(size_t index, double c) {
+      images::plot(view_.color, view_.alpha, index, c);
+    }
+
+    // Empty the histogram so that it can be reused (e.g. for the next frame
+    // of an animation) without reallocating, and page-faulting in, fresh
+    // planes. Must not race with plot().
+    void clear(parallel::thread_pool *pool = nullptr) {
+      const ptrdiff_t width = dimensions().x;
+      parallel::for_each_block(pool, dimensions().y, 16, [&](
+        size_t begin, size_t end
+      ) {
+        for(size_t y = begin; y != end; y++) {
+          std::fill_n(view_.color.row_begin(y), width, 0.0);
+          // A compact_count row is a range of proxies, not an iterator.
+          auto alpha = view_.alpha.row_begin(y);
+          for(ptrdiff_t x = 0; x != width; x++)
+            alpha[x] = 0;
+        }
+      });
+    }
+
+    // The color and alpha planes. These are only safe to touch while holding
+    // the relevant band's lock, or once every writer is done.
+    inline const image_view & view() const {
+      return view_;
+    }
+  private:
+    static ptrdiff_t band_rows(const boost::gil::point2<ptrdiff_t> &dimensions,
+                               ptrdiff_t max_bands) {
+      return std::max<ptrdiff_t>(
+        1, (dimensions.y + max_bands - 1) / max_bands
+      );
+    }
+
+    std::unique_ptr<image_data> storage_;
+    image_view view_;
+    ptrdiff_t band_rows_;
+    std::vector<std::mutex> locks_;
+    boost::gil::point2<ptrdiff_t> canvas_, origin_ = {0, 0};
+  };
+
+  // A small per-thread buffer of hits that are flushed into a
+  // shared_image_data in batches, grouped by band so that each band's lock
+  // is taken at most once per flush. If `counters` is given, each flush is
+  // counted and timed there.
+  template<typename Counter = uint32_t>
+  class hit_buffer {
+  public:
+    struct hit {
+      size_t index;
+      uint32_t band;
+      double color;
+    };
+
+    explicit hit_buffer(shared_image_data<Counter> &dst,
+                        stats::counters *counters = nullptr,
+                        size_t capacity = 4096)
+      : dst_(dst), counters_(counters), capacity_(capacity),
+        sorted_(capacity), offsets_(dst.bands() + 1) {
+      hits_.reserve(capacity);
+    }
+
+    hit_buffer(const hit_buffer &) = delete;
+    hit_buffer & operator =(const hit_buffer &) = delete;
+
+    ~hit_buffer() {
+      flush();
+    }
+
+    inline void operator ()(const boost::gil::point2<ptrdiff_t> &pt,
+                            double color) {
+      hits_.push_back({
+        dst_.index(pt), static_cast<uint32_t>(dst_.band(pt)), color
+      });
+      if(hits_.size() == capacity_)
+        flush();
+    }
+
+    void flush() {
+      if(hits_.empty())
+        return;
+      auto start = counters_ ? stats::clock::now() : stats::clock::time_point();
+
+      std::fill(offsets_.begin(), offsets_.end(), 0);
+      for(const auto &h : hits_)
+        offsets_[h.band + 1]++;
+      for(size_t b = 0; b != dst_.bands(); b++)
+        offsets_[b + 1] += offsets_[b];
+      for(const auto &h : hits_)
+        sorted_[offsets_[h.band]++] = h;
+
+      // offsets_[b] is now the end of band b. Take the uncontended bands
+      // first and come back for the rest.
+      auto apply = [&, this](size_t b) {
+        size_t begin = b ? offsets_[b - 1] : 0;
+        for(size_t i = begin; i != offsets_[b]; i++)
+          dst_.plot(sorted_[i].index, sorted_[i].color);
+      };
+
+      pending_.clear();
+      for(size_t b = 0; b != dst_.bands(); b++) {
+        if(offsets_[b] == (b ? offsets_[b - 1] : 0))
+          continue;
+        std::unique_lock<std::mutex> lock(dst_.lock(b), std::try_to_lock);
+        if(lock)
+          apply(b);
+        else
+          pending_.push_back(b);
+      }
+      for(auto b : pending_) {
+        std::lock_guard<std::mutex> lock(dst_.lock(b));
+        apply(b);
+      }
+
+      hits_.clear();
+      if(counters_) {
+        counters_->flushes++;
+        counters_->flush_time += stats::clock::now() - start;
+      }
+    }
+  private:
+    shared_image_data<Counter> &dst_;
+    stats::counters *counters_;
+    size_t capacity_;
+    std::vector<hit> hits_, sorted_;
+    std::vector<size_t> offsets_, pending_;
+  };
+
+} // namespace images
+
+#endif
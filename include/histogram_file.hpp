@@ -0,0 +1,172 @@
+#ifndef INC_MUSPELHEIM_HISTOGRAM_FILE_HPP
+#define INC_MUSPELHEIM_HISTOGRAM_FILE_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/gil/image_view_factory.hpp>
+
+#include "images.hpp"
+#include "palette.hpp"
+
+namespace images {
+
+  // The on-disk layout of a histogram file: this header, then the palette
+  // at `palette_offset`, then the color plane (the sum of each pixel's color
+  // indices) at `color_offset`, then the alpha plane at `alpha_offset`. Both
+  // planes are stored row-major with no padding, in native byte order.
+  struct histogram_header {
+    static constexpr char file_magic[8] = {'M', 'U', 'S', 'P', 'H', 'S', 'T',
+                                           '\0'};
+    static constexpr uint32_t current_version = 2;
+    static constexpr uint32_t native_byte_order = 0x01020304;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+
+    uint64_t width, height;
+    uint32_t color_size, alpha_size;
+
+    // The palette's entries are `palette_channels` channels of
+    // `palette_channel_size` bytes each.
+    uint32_t palette_channels, palette_channel_size;
+    uint64_t palette_size;
+
+    // The number of iterations accumulated so far, and a hash of the
+    // function system that produced them.
+    uint64_t steps;
+    uint64_t flame_hash;
+
+    uint64_t palette_offset, color_offset, alpha_offset, file_size;
+  };
+
+  // A histogram stored in a memory-mapped file, so that a render can
+  // accumulate directly into it, checkpoint it, and pick up where it left
+  // off later. The file can be larger than RAM; the page cache handles it.
+  class histogram_file {
+  public:
+    // Create (or truncate) `filename` as an empty histogram, with room for a
+    // palette of `palette_size` entries.
+    histogram_file(const std::string &filename,
+                   const boost::gil::point2<ptrdiff_t> &dimensions,
+                   uint32_t color_size, uint32_t alpha_size,
+                   uint32_t palette_channels, uint32_t palette_channel_size,
+                   uint64_t palette_size, uint64_t flame_hash);
+
+    // Open an existing histogram file. If it's opened read-only, the planes
+    // must not be written to.
+    explicit histogram_file(const std::string &filename,
+                            bool writable = true);
+
+    histogram_file(histogram_file &&other);
+    histogram_file & operator =(histogram_file &&other);
+    ~histogram_file();
+
+    inline const histogram_header & header() const {
+      return *static_cast<const histogram_header*>(data_);
+    }
+
+    inline boost::gil::point2<ptrdiff_t> dimensions() const {
+      return {static_cast<ptrdiff_t>(header().width),
+              static_cast<ptrdiff_t>(header().height)};
+    }
+
+    inline void * palette_data() const {
+      return static_cast<char*>(data_) + header().palette_offset;
+    }
+
+    inline void * color_data() const {
+      return static_cast<char*>(data_) + header().color_offset;
+    }
+
+    inline void * alpha_data() const {
+      return static_cast<char*>(data_) + header().alpha_offset;
+    }
+
+    // Record that `steps` iterations have been accumulated and flush
+    // everything to disk.
+    void checkpoint(uint64_t steps);
+  private:
+    void map(size_t size, bool writable = true);
+    void unmap();
+
+    int fd_ = -1;
+    void *data_ = nullptr;
+    size_t size_ = 0;
+  };
+
+  // Get typed views of the planes in `file`, checking that its pixel layout
+  // matches.
+  inline raw_image_view<> histogram_view(const histogram_file &file) {
+    using namespace boost::gil;
+    using view_type = raw_image_view<>;
+    using color_t = typename view_type::color_view::value_type;
+
+    const auto &h = file.header();
+    if(h.color_size != sizeof(color_t) || h.alpha_size != sizeof(uint32_t))
+      throw std::runtime_error("histogram file has the wrong pixel format");
+
+    auto dims = file.dimensions();
+    return {
+      interleaved_view(
+        dims.x, dims.y,
+        static_cast<typename view_type::color_view::x_iterator>(
+          file.color_data()
+        ),
+        dims.x * sizeof(color_t)
+      ),
+      interleaved_view(
+        dims.x, dims.y,
+        static_cast<typename view_type::alpha_view::x_iterator>(
+          file.alpha_data()
+        ),
+        dims.x * sizeof(uint32_t)
+      )
+    };
+  }
+
+  // Read the palette stored in `file`, checking that its pixel layout
+  // matches.
+  template<typename ColorPixel>
+  colors::palette<ColorPixel> histogram_palette(const histogram_file &file) {
+    using channel_t = typename boost::gil::channel_type<ColorPixel>::type;
+
+    const auto &h = file.header();
+    if(h.palette_channels != boost::gil::size<ColorPixel>::value ||
+       h.palette_channel_size != sizeof(channel_t) || h.palette_size == 0)
+      throw std::runtime_error("histogram file has the wrong palette format");
+
+    const auto *entries = static_cast<const ColorPixel*>(file.palette_data());
+    return colors::palette<ColorPixel>(std::vector<ColorPixel>(
+      entries, entries + h.palette_size
+    ));
+  }
+
+  template<typename ColorPixel>
+  histogram_file
+  create_histogram_file(const std::string &filename,
+                        const boost::gil::point2<ptrdiff_t> &dimensions,
+                        const colors::palette<ColorPixel> &palette,
+                        uint64_t flame_hash) {
+    using channel_t = typename boost::gil::channel_type<ColorPixel>::type;
+    using color_t = typename raw_image_view<>::color_view::value_type;
+    static_assert(sizeof(ColorPixel) ==
+                  sizeof(channel_t) * boost::gil::size<ColorPixel>::value,
+                  "palette entries must be tightly packed");
+
+    histogram_file file(
+      filename, dimensions, sizeof(color_t), sizeof(uint32_t),
+      boost::gil::size<ColorPixel>::value, sizeof(channel_t), palette.size(),
+      flame_hash
+    );
+    std::copy(palette.entries().begin(), palette.entries().end(),
+              static_cast<ColorPixel*>(file.palette_data()));
+    return file;
+  }
+
+} // namespace images
+
+#endif
@@ -1,100 +1,652 @@
 #ifndef INC_MUSPELHEIM_IFS_HPP
 #define INC_MUSPELHEIM_IFS_HPP
 
-#include <functional>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <optional>
 #include <random>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
+#include "alias_table.hpp"
+#include "camera.hpp"
+#include "random.hpp"
+#include "histogram.hpp"
 #include "images.hpp"
+#include "palette.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+#include "symmetry.hpp"
+#include "variations.hpp"
 #include "vec2d.hpp"
 
 namespace ifs {
 
+  template<typename Pixel>
+  class iterated_function_system;
+
   template<typename Pixel>
   class iterated_function {
   public:
     using pixel_type = Pixel;
-    using function_type = std::function<
-      math::vec2d(const math::vec2d &, const math::affine_transform &)
-    >;
+    using function_type = math::variation;
     using value_type = std::pair<function_type, double>;
 
+    // `color_index` is this function's position in the palette; if it's not
+    // given, the function system spreads its functions evenly over [0, 1].
     iterated_function(
       const function_type &f, const math::affine_transform &transform,
       const pixel_type &color,
-      const math::affine_transform &post = math::identity()
-    ) : iterated_function({{f, 1}}, transform, color, post) {}
+      const math::affine_transform &post = math::identity(),
+      double weight = 1, std::optional<double> color_index = std::nullopt
+    ) : iterated_function({{f, 1}}, transform, color, post, weight,
+                          color_index) {}
 
     iterated_function(
       const std::initializer_list<value_type> &f,
       const math::affine_transform &transform, const pixel_type &color,
-      const math::affine_transform &post = math::identity()
-    ) : f_(f), transform_(transform), color_(color), post_(post) {}
+      const math::affine_transform &post = math::identity(),
+      double weight = 1, std::optional<double> color_index = std::nullopt
+    ) : iterated_function(std::vector<value_type>(f), transform, color, post,
+                          weight, color_index) {}
 
-    inline math::vec2d operator ()(const math::vec2d &p) const {
+    iterated_function(
+      std::vector<value_type> f, const math::affine_transform &transform,
+      const pixel_type &color,
+      const math::affine_transform &post = math::identity(),
+      double weight = 1, std::optional<double> color_index = std::nullopt
+    ) : f_(std::move(f)), transform_(transform), color_(color), post_(post),
+        weight_(weight), color_index_(color_index) {
+      double total = 0;
+      linear_ = true;
+      for(const auto &i : f_) {
+        linear_ = linear_ && i.first.type() == math::variation_type::linear;
+        total += i.second;
+      }
+      if(linear_)
+        composite_ = post_ * math::scale(total) * transform_;
+    }
+
+    inline math::vec2d
+    operator ()(const math::vec2d &p,
+                math::precision prec = math::precision::exact) const {
+      if(linear_)
+        return composite_(p);
+      return post_(vary(transform_(p), prec));
+    }
+
+    // Evaluate the weighted sum of variations on an already-transformed
+    // point; this is the part of operator() between `transform` and `post`.
+    inline math::vec2d
+    vary(const math::vec2d &transformed,
+         math::precision prec = math::precision::exact) const {
       math::vec2d value = {0, 0};
-      const auto &transformed = transform_(p);
       for(const auto &i : f_)
-        value += i.second * i.first(transformed, transform_);
-      return post_(value);
+        value += i.second * i.first(transformed, transform_, prec);
+      return value;
+    }
+
+    // The lane-wise equivalent of vary(), in either floating-point type:
+    // `out_x` and `out_y` must be zeroed by the caller.
+    template<typename T>
+    inline void vary(const T *x, const T *y, T *out_x, T *out_y, size_t n,
+                     math::precision prec = math::precision::exact) const {
+      const math::basic_affine_transform<T> transform(transform_);
+      for(const auto &i : f_) {
+        i.first.accumulate(static_cast<T>(i.second), transform, x, y, out_x,
+                           out_y, n, prec);
+      }
+    }
+
+    // True if every variation is linear, in which case the whole function is
+    // the single affine transform returned by composite().
+    inline bool linear() const {
+      return linear_;
+    }
+
+    inline const math::affine_transform & composite() const {
+      assert(linear_);
+      return composite_;
+    }
+
+    inline const math::affine_transform & transform() const {
+      return transform_;
+    }
+
+    inline const math::affine_transform & post() const {
+      return post_;
+    }
+
+    inline const std::vector<value_type> & variations() const {
+      return f_;
     }
 
     inline const pixel_type & color() const {
       return color_;
     }
+
+    // Where color() sits in the palette; each step moves a walker's color
+    // index halfway towards this.
+    inline double color_index() const {
+      assert(color_index_);
+      return *color_index_;
+    }
+
+    // The relative probability of choosing this function at each step.
+    inline double weight() const {
+      return weight_;
+    }
   private:
+    friend class iterated_function_system<Pixel>;
+
     std::vector<value_type> f_;
     math::affine_transform transform_;
     pixel_type color_;
     math::affine_transform post_;
+    double weight_;
+    std::optional<double> color_index_;
+
+    bool linear_;
+    math::affine_transform composite_;
   };
 
   template<typename Pixel>
-  using iterated_function_system = std::vector<iterated_function<Pixel>>;
+  class iterated_function_system {
+  public:
+    using value_type = iterated_function<Pixel>;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+    using xaos_matrix = std::vector<std::vector<double>>;
+
+    // A sentinel "previous function" for walkers that haven't moved yet.
+    static constexpr size_t no_function = static_cast<size_t>(-1);
+
+    iterated_function_system(std::initializer_list<value_type> funcs)
+      : iterated_function_system(std::vector<value_type>(funcs)) {}
+
+    // `xaos[i][j]` scales the weight of function j when the previous step
+    // used function i, turning the chaos game into a Markov chain.
+    iterated_function_system(std::initializer_list<value_type> funcs,
+                             xaos_matrix xaos, const ifs::symmetry &sym = {})
+      : iterated_function_system(std::vector<value_type>(funcs),
+                                 std::move(xaos), sym) {}
+
+    // Build a system at runtime, e.g. from a flame file (see flame_file.hpp).
+    // A system may be empty, but then it can't be rendered.
+    explicit iterated_function_system(std::vector<value_type> funcs,
+                                      xaos_matrix xaos = {},
+                                      const ifs::symmetry &sym = {})
+      : funcs_(std::move(funcs)), xaos_(std::move(xaos)), symmetry_(sym) {
+      assign_color_indices();
+      build_selectors();
+    }
+
+    // Declare that the flame's density has the symmetry `sym`; see
+    // symmetry.hpp.
+    iterated_function_system(std::initializer_list<value_type> funcs,
+                             const ifs::symmetry &sym)
+      : iterated_function_system(funcs, {}, sym) {}
+
+    inline const value_type & operator [](size_t i) const {
+      return funcs_[i];
+    }
+
+    inline size_t size() const {
+      return funcs_.size();
+    }
+
+    inline bool empty() const {
+      return funcs_.empty();
+    }
+
+    inline const_iterator begin() const {
+      return funcs_.begin();
+    }
+
+    inline const_iterator end() const {
+      return funcs_.end();
+    }
+
+    inline const xaos_matrix & xaos() const {
+      return xaos_;
+    }
+
+    // The symmetry each plotted point is replicated under.
+    inline const ifs::symmetry & symmetry() const {
+      return symmetry_;
+    }
+
+    inline void set_symmetry(const ifs::symmetry &sym) {
+      symmetry_ = sym;
+    }
+
+    // Where the flame is viewed from; see camera.hpp.
+    inline const ifs::camera & camera() const {
+      return camera_;
+    }
+
+    inline void set_camera(const ifs::camera &cam) {
+      camera_ = cam;
+    }
+
+    // The default palette: a gradient through each function's color at its
+    // color index.
+    colors::palette<Pixel> palette() const {
+      std::vector<typename colors::palette<Pixel>::stop> stops;
+      for(const auto &f : funcs_)
+        stops.emplace_back(f.color_index(), f.color());
+      return colors::palette<Pixel>::gradient(std::move(stops));
+    }
+
+    // Pick the next function given the previous one (or `no_function`).
+    template<typename Engine>
+    inline size_t select(size_t prev, Engine &engine) const {
+      if(prev == no_function || xaos_selectors_.empty())
+        return selector_(engine);
+      return xaos_selectors_[prev](engine);
+    }
+  private:
+    void assign_color_indices() {
+      for(size_t i = 0; i != funcs_.size(); i++) {
+        auto &index = funcs_[i].color_index_;
+        if(!index)
+          index = funcs_.size() > 1 ? double(i) / (funcs_.size() - 1) : 0.0;
+      }
+    }
+
+    void build_selectors() {
+      if(funcs_.empty())
+        return;
+
+      std::vector<double> weights;
+      for(const auto &f : funcs_)
+        weights.push_back(f.weight());
+      selector_ = rng::alias_table(weights);
+
+      if(xaos_.empty())
+        return;
+      if(xaos_.size() != funcs_.size())
+        throw std::invalid_argument("xaos matrix must have one row per "
+                                    "function");
+
+      for(const auto &row : xaos_) {
+        if(row.size() != funcs_.size())
+          throw std::invalid_argument("xaos matrix must be square");
+        std::vector<double> row_weights(weights);
+        for(size_t j = 0; j != row.size(); j++)
+          row_weights[j] *= row[j];
+        xaos_selectors_.emplace_back(row_weights);
+      }
+    }
+
+    std::vector<value_type> funcs_;
+    xaos_matrix xaos_;
+    ifs::symmetry symmetry_;
+    ifs::camera camera_;
+    rng::alias_table selector_;
+    std::vector<rng::alias_table> xaos_selectors_;
+  };
 
+  namespace detail {
+    // FNV-1a, used to fingerprint function systems.
+    class fnv1a {
+    public:
+      template<typename T>
+      void add(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const auto *bytes = reinterpret_cast<const unsigned char*>(&value);
+        for(size_t i = 0; i != sizeof(T); i++) {
+          hash_ ^= bytes[i];
+          hash_ *= 0x100000001b3;
+        }
+      }
+
+      void add(const math::affine_transform &t) {
+        for(double v : {t.a, t.b, t.c, t.d, t.e, t.f})
+          add(v);
+      }
+
+      uint64_t value() const {
+        return hash_;
+      }
+    private:
+      uint64_t hash_ = 0xcbf29ce484222325;
+    };
+  }
+
+  // A fingerprint of everything that affects what a function system draws,
+  // so that a saved histogram can be checked against the flame resuming it.
+  // Custom variations only contribute the fact that they're custom.
   template<typename Pixel>
-  images::raw_image_data<Pixel>
-  chaos_game(const iterated_function_system<Pixel> &funcs,
-             const boost::gil::point2<ptrdiff_t> &dimensions,
-             size_t num_iterations = 10000000) {
+  uint64_t hash(const iterated_function_system<Pixel> &funcs) {
+    detail::fnv1a h;
+    h.add(funcs.size());
+    for(const auto &f : funcs) {
+      h.add(f.transform());
+      h.add(f.post());
+      h.add(f.weight());
+      h.add(f.color_index());
+      for(size_t chan = 0; chan != boost::gil::size<Pixel>::value; chan++)
+        h.add(f.color()[chan]);
+      for(const auto &v : f.variations()) {
+        h.add(v.first.type());
+        h.add(v.second);
+      }
+    }
+    for(const auto &row : funcs.xaos()) {
+      for(double v : row)
+        h.add(v);
+    }
+    // Only hash symmetry when there is some, so that histograms of flames
+    // without any keep their hashes. (A flame that declares symmetry, like
+    // the Koch snowflake, hashes differently from before it did.)
+    if(!funcs.symmetry().trivial()) {
+      h.add(funcs.symmetry().order);
+      h.add(funcs.symmetry().reflect);
+    }
+    // Likewise for the camera.
+    if(funcs.camera() != ifs::camera{}) {
+      h.add(funcs.camera().center.x);
+      h.add(funcs.camera().center.y);
+      h.add(funcs.camera().zoom);
+      h.add(funcs.camera().rotation);
+    }
+    return h.value();
+  }
+
+  // A batch of independent walkers stored as structure-of-arrays. Each step
+  // picks a function for every walker, then groups the walkers by function so
+  // that every function's transforms run over a contiguous span of lanes.
+  // Every walker also carries a color index, which each step moves halfway
+  // towards the chosen function's.
+  //
+  // The walkers iterate in `Real`: float fits twice as many lanes in each
+  // vector and is precise enough at screen or print scale, while double
+  // holds up for deep zooms. The built-in variations are evaluated in
+  // `precision` (see math::precision).
+  template<typename Pixel, typename Real = double>
+  class walker_batch {
+  public:
+    using real_type = Real;
+    static constexpr size_t default_size = 256;
+
+    explicit walker_batch(const iterated_function_system<Pixel> &funcs,
+                          math::precision precision = math::precision::exact,
+                          size_t size = default_size)
+      : funcs_(funcs), precision_(precision), x_(size), y_(size), c_(size),
+        func_(size, iterated_function_system<Pixel>::no_function),
+        scratch_x_(size), scratch_y_(size), scratch_c_(size),
+        selected_(size), offsets_(funcs.size() + 1) {
+      program_.reserve(funcs.size());
+      for(const auto &func : funcs) {
+        size_t first = terms_.size();
+        if(!func.linear()) {
+          for(const auto &[v, weight] : func.variations())
+            terms_.push_back({&v, static_cast<Real>(weight)});
+        }
+        program_.push_back({
+          convert(func.linear() ? func.composite() : math::identity()),
+          convert(func.transform()), convert(func.post()),
+          static_cast<Real>(func.color_index()), func.linear(), first,
+          terms_.size()
+        });
+      }
+    }
+
+    template<typename Engine>
+    void seed(Engine &engine, size_t warmup = 20) {
+      for(size_t i = 0; i != size(); i++) {
+        x_[i] = static_cast<Real>(2 * rng::canonical(engine) - 1);
+        y_[i] = static_cast<Real>(2 * rng::canonical(engine) - 1);
+        c_[i] = static_cast<Real>(rng::canonical(engine));
+      }
+      for(size_t i = 0; i != warmup; i++)
+        step(engine);
+    }
+
+    template<typename Engine>
+    void step(Engine &engine) {
+      const size_t n = size();
+
+      std::fill(offsets_.begin(), offsets_.end(), 0);
+      for(size_t i = 0; i != n; i++) {
+        selected_[i] = funcs_.select(func_[i], engine);
+        offsets_[selected_[i] + 1]++;
+      }
+      for(size_t f = 0; f != funcs_.size(); f++)
+        offsets_[f + 1] += offsets_[f];
+
+      // Counting sort the walkers by their chosen function. Walkers are
+      // interchangeable, so there's no need to remember where they came from.
+      for(size_t i = 0; i != n; i++) {
+        size_t dst = offsets_[selected_[i]]++;
+        scratch_x_[dst] = x_[i];
+        scratch_y_[dst] = y_[i];
+        scratch_c_[dst] = c_[i];
+        func_[dst] = selected_[i];
+      }
+
+      size_t begin = 0;
+      for(size_t f = 0; f != funcs_.size(); f++) {
+        size_t end = offsets_[f], n = end - begin;
+        const auto &op = program_[f];
+        Real *sx = scratch_x_.data() + begin, *sy = scratch_y_.data() + begin;
+
+        Real *dx = x_.data() + begin, *dy = y_.data() + begin;
+
+        if(op.linear) {
+          simd::affine(op.composite, sx, sy, n);
+          std::copy(sx, sx + n, dx);
+          std::copy(sy, sy + n, dy);
+        } else {
+          simd::affine(op.transform, sx, sy, n);
+          std::fill(dx, dx + n, Real(0));
+          std::fill(dy, dy + n, Real(0));
+          for(size_t t = op.first_term; t != op.last_term; t++) {
+            const auto &term = terms_[t];
+            term.variation->accumulate(term.weight, op.transform, sx, sy, dx,
+                                       dy, n, precision_);
+          }
+          simd::affine(op.post, dx, dy, n);
+        }
+
+        for(size_t i = begin; i != end; i++)
+          c_[i] = (scratch_c_[i] + op.color) * 0.5;
+        begin = end;
+      }
+    }
+
+    inline size_t size() const {
+      return x_.size();
+    }
+
+    inline math::basic_vec2d<Real> point(size_t i) const {
+      return {x_[i], y_[i]};
+    }
+
+    inline Real color(size_t i) const {
+      return c_[i];
+    }
+
+    inline const iterated_function_system<Pixel> & system() const {
+      return funcs_;
+    }
+
+    inline math::precision precision() const {
+      return precision_;
+    }
+
+    inline const iterated_function<Pixel> & function(size_t i) const {
+      return funcs_[func_[i]];
+    }
+
+    inline size_t function_index(size_t i) const {
+      return func_[i];
+    }
+  private:
+    // The function system compiled into a flat program: one entry per
+    // function, with its affines converted to Real (and pre-composed if it's
+    // linear), and its variations and their weights laid out contiguously in
+    // terms_, so that a step never chases the system's own nested vectors.
+    struct function_op {
+      math::basic_affine_transform<Real> composite, transform, post;
+      Real color;
+      bool linear;
+      size_t first_term, last_term;
+    };
+
+    struct term {
+      const math::variation *variation;
+      Real weight;
+    };
+
+    static math::basic_affine_transform<Real>
+    convert(const math::affine_transform &t) {
+      return math::basic_affine_transform<Real>(t);
+    }
+
+    const iterated_function_system<Pixel> &funcs_;
+    math::precision precision_;
+    std::vector<function_op> program_;
+    std::vector<term> terms_;
+    std::vector<Real> x_, y_, c_;
+    std::vector<size_t> func_;
+
+    std::vector<Real> scratch_x_, scratch_y_, scratch_c_;
+    std::vector<size_t> selected_, offsets_;
+  };
+
+  // Run `num_iterations` steps of the chaos game on an already-seeded batch
+  // of walkers, mapping each point onto the canvas with `to_canvas` and
+  // passing every hit that lands in the `dimensions` pixels from `origin` to
+  // `plot(pixel, color_index)`, with the pixel relative to `origin`. Each
+  // point is plotted along with its images under the function system's
+  // symmetry, all with the same color index. If `counters` is given, tally
+  // the iterations, misses (of the points themselves, not their images) and
+  // function picks there.
+  template<typename Pixel, typename Real, typename Engine, typename Plot>
+  void chaos_game(walker_batch<Pixel, Real> &walkers, Engine &engine,
+                  const math::affine_transform &to_canvas,
+                  const boost::gil::point2<ptrdiff_t> &origin,
+                  const boost::gil::point2<ptrdiff_t> &dimensions,
+                  size_t num_iterations, Plot &&plot,
+                  stats::counters *counters = nullptr) {
     using namespace boost::gil;
     using image_pt = point2<ptrdiff_t>;
 
-    std::default_random_engine engine(std::random_device{}());
-    std::uniform_int_distribution<size_t> random_func(0, funcs.size() - 1);
-    std::uniform_real_distribution<double> random_biunit(-1, 1);
-
-    images::raw_image_data<Pixel> result(dimensions);
-    auto color = view(result.color);
-    auto alpha = view(result.alpha);
+    // Each symmetry image pre-composed with the map onto the canvas, so a
+    // point costs one affine per image to place.
+    std::vector<math::basic_affine_transform<Real>> projections;
+    for(const auto &g : walkers.system().symmetry().transforms())
+      projections.emplace_back(to_canvas * g);
 
-    math::vec2d point(random_biunit(engine), random_biunit(engine));
+    const double x0 = origin.x, x1 = origin.x + dimensions.x;
+    const double y0 = origin.y, y1 = origin.y + dimensions.y;
+    for(size_t i = 0; i < num_iterations; i += walkers.size()) {
+      walkers.step(engine);
 
-    for(size_t i = 0; i < 20; i++)
-      point = funcs[random_func(engine)](point);
+      size_t lanes = std::min(walkers.size(), num_iterations - i);
+      for(size_t lane = 0; lane != lanes; lane++) {
+        for(size_t g = 0; g != projections.size(); g++) {
+          auto point = projections[g](walkers.point(lane));
+          double x = point.x, y = point.y;
 
-    for(size_t i = 0; i < num_iterations; i++) {
-      auto &f = funcs[random_func(engine)];
-      point = f(point);
-      image_pt pt(
-        static_cast<ptrdiff_t>((point.x + 1) / 2 * alpha.width()),
-        static_cast<ptrdiff_t>((point.y + 1) / 2 * alpha.height())
-      );
-      if(pt.x < 0 || pt.x >= alpha.width() ||
-         pt.y < 0 || pt.y >= alpha.height())
-        continue;
+          // Compare before truncating so that NaNs (which fail every
+          // comparison) and huge values are rejected safely.
+          if(!(x >= x0 && x < x1 && y >= y0 && y < y1)) {
+            if(counters && g == 0) {
+              if(std::isfinite(x) && std::isfinite(y))
+                counters->off_canvas++;
+              else
+                counters->non_finite++;
+            }
+            continue;
+          }
 
-      if(!alpha(pt))
-        color(pt) = f.color();
-      else
-        color(pt) = images::blend(color(pt), f.color(), 0.9);
+          plot(image_pt(static_cast<ptrdiff_t>(x) - origin.x,
+                        static_cast<ptrdiff_t>(y) - origin.y),
+               walkers.color(lane));
+        }
+      }
 
-      alpha(pt)++;
+      if(counters) {
+        counters->iterations += lanes;
+        for(size_t lane = 0; lane != lanes; lane++)
+          counters->picks[walkers.function_index(lane)]++;
+      }
     }
+  }
+
+  // The same, over the whole of a canvas of `dimensions` pixels viewed
+  // through the function system's camera.
+  template<typename Pixel, typename Real, typename Engine, typename Plot>
+  void chaos_game(walker_batch<Pixel, Real> &walkers, Engine &engine,
+                  const boost::gil::point2<ptrdiff_t> &dimensions,
+                  size_t num_iterations, Plot &&plot,
+                  stats::counters *counters = nullptr) {
+    chaos_game(walkers, engine,
+               walkers.system().camera().to_canvas(dimensions),
+               boost::gil::point2<ptrdiff_t>(0, 0), dimensions,
+               num_iterations, std::forward<Plot>(plot), counters);
+  }
+
+  // The overloads below iterate in `Real` and `precision` (see
+  // walker_batch).
+  template<typename Real = double, typename Pixel, typename Plot>
+  void chaos_game(const iterated_function_system<Pixel> &funcs,
+                  const boost::gil::point2<ptrdiff_t> &dimensions,
+                  size_t num_iterations, Plot &&plot,
+                  math::precision precision = math::precision::exact) {
+    rng::xoshiro256pp engine(std::random_device{}());
+
+    walker_batch<Pixel, Real> walkers(funcs, precision);
+    walkers.seed(engine);
+    chaos_game(walkers, engine, dimensions, num_iterations,
+               std::forward<Plot>(plot));
+  }
+
+  // Render into a new histogram, with hit counts of type `Counter` (see
+  // counters.hpp).
+  template<typename Counter = uint32_t, typename Real = double,
+           typename Pixel>
+  images::raw_image_data<Counter>
+  chaos_game(const iterated_function_system<Pixel> &funcs,
+             const boost::gil::point2<ptrdiff_t> &dimensions,
+             size_t num_iterations = 10000000,
+             math::precision precision = math::precision::exact) {
+    using namespace boost::gil;
+
+    images::raw_image_data<Counter> result(dimensions);
+    auto color = view(result.color);
+    auto alpha = result.view().alpha;
+
+    chaos_game<Real>(funcs, dimensions, num_iterations, [&](
+      const point2<ptrdiff_t> &pt, double c
+    ) {
+      images::plot(color, alpha, pt.y * dimensions.x + pt.x, c);
+    }, precision);
 
     return result;
   }
 
+  // Run the chaos game on one of several threads sharing a single histogram.
+  template<typename Real = double, typename Pixel, typename Counter>
+  void chaos_game(const iterated_function_system<Pixel> &funcs,
+                  images::shared_image_data<Counter> &dst,
+                  size_t num_iterations = 10000000,
+                  math::precision precision = math::precision::exact) {
+    using namespace boost::gil;
+
+    images::hit_buffer hits(dst);
+    chaos_game<Real>(funcs, dst.dimensions(), num_iterations, [&](
+      const point2<ptrdiff_t> &pt, double c
+    ) {
+      hits(pt, c);
+    }, precision);
+  }
+
 } // namespace ifs
 
 #endif
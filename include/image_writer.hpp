@@ -0,0 +1,68 @@
+#ifndef INC_MUSPELHEIM_IMAGE_WRITER_HPP
+#define INC_MUSPELHEIM_IMAGE_WRITER_HPP
+
+#include <string>
+
+#include "images.hpp"
+#include "pfm_writer.hpp"
+#include "png_writer.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace images {
+
+  // The formats a tone-mapped histogram can be written in. `pfm` keeps the
+  // tone mapper's full float output, unquantized but already log-scaled and
+  // gamma corrected, so that it can be graded elsewhere.
+  enum class image_format {
+    png8,
+    png16,
+    pfm
+  };
+
+  // Pick a format for `filename` by its extension: PFM for ".pfm", and
+  // otherwise PNG with `bit_depth` (8 or 16) bits per channel.
+  inline image_format image_format_for(const std::string &filename,
+                                       int bit_depth = 8) {
+    const std::string ext = ".pfm";
+    if(filename.size() >= ext.size() &&
+       filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0)
+      return image_format::pfm;
+    return bit_depth == 16 ? image_format::png16 : image_format::png8;
+  }
+
+  template<typename ColorPixel, typename Counter>
+  void write_image(const std::string &filename,
+                   const tone_mapper<ColorPixel, Counter> &mapper,
+                   image_format format, parallel::thread_pool *pool = nullptr,
+                   stats::timings *timings = nullptr) {
+    switch(format) {
+    case image_format::png8:
+      write_png(filename, mapper, pool, timings, 8);
+      break;
+    case image_format::png16:
+      write_png(filename, mapper, pool, timings, 16);
+      break;
+    case image_format::pfm:
+      write_pfm(filename, mapper, pool, timings);
+      break;
+    }
+  }
+
+  template<typename Counter, typename ColorPixel>
+  void write_image(const std::string &filename,
+                   const raw_image_view<Counter> &src,
+                   const colors::palette<ColorPixel> &palette,
+                   const tone_map_options &opts, image_format format,
+                   parallel::thread_pool *pool = nullptr,
+                   stats::timings *timings = nullptr) {
+    auto start = stats::clock::now();
+    tone_mapper<ColorPixel, Counter> mapper(src, palette, opts, pool);
+    if(timings)
+      timings->add("tone_map", stats::clock::now() - start);
+    write_image(filename, mapper, format, pool, timings);
+  }
+
+} // namespace images
+
+#endif
@@ -1,17 +1,39 @@
 #ifndef INC_MUSPELHEIM_IMAGE_HPP
 #define INC_MUSPELHEIM_IMAGE_HPP
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
 #include <boost/gil/image.hpp>
 
+#include "counters.hpp"
+#include "palette.hpp"
+#include "simd.hpp"
+#include "thread_pool.hpp"
+
 namespace images {
 
-  template<typename Pixel>
-  Pixel blend(const Pixel &a, const Pixel &b, double ratio) {
-    Pixel p;
-    for(size_t i = 0; i != boost::gil::size<Pixel>::value; i++)
-      p[i] = a[i] * ratio + b[i] * (1 - ratio);
-    return p;
-  }
+  // Mutable views of the color and alpha planes of an image_data, or of
+  // planes that live somewhere else (e.g. a memory-mapped file).
+  template<typename ColorPixel, typename AlphaPixel>
+  struct image_data_view {
+    using color_view = typename boost::gil::image<ColorPixel, false>::view_t;
+    using alpha_view = typename alpha_plane<AlphaPixel>::view;
+
+    auto dimensions() const {
+      return color.dimensions();
+    }
+
+    color_view color;
+    alpha_view alpha;
+  };
 
   template<typename ColorPixel, typename AlphaPixel>
   struct image_data {
@@ -19,7 +41,7 @@ namespace images {
     using color_image = boost::gil::image<color_pixel, false>;
 
     using alpha_pixel = AlphaPixel;
-    using alpha_image = boost::gil::image<alpha_pixel, false>;
+    using alpha_image = typename alpha_plane<alpha_pixel>::image;
 
     template<typename Color, typename Alpha>
     image_data(Color &&color, Alpha &&alpha) :
@@ -28,74 +50,116 @@ namespace images {
 
     explicit image_data(const boost::gil::point2<ptrdiff_t> &dimensions) :
       color(dimensions, color_pixel(0), 0),
-      alpha(dimensions, alpha_pixel(0), 0) {}
+      alpha(alpha_plane<alpha_pixel>::make(dimensions)) {}
 
     auto dimensions() const {
       return color.dimensions();
     }
 
+    image_data_view<ColorPixel, AlphaPixel> view() {
+      return {boost::gil::view(color),
+              alpha_plane<alpha_pixel>::make_view(alpha)};
+    }
+
+    auto alpha_view() const {
+      return alpha_plane<alpha_pixel>::make_const_view(alpha);
+    }
+
     color_image color;
     alpha_image alpha;
   };
 
-  template<typename ColorPixel>
-  using raw_image_data = image_data<ColorPixel, uint32_t>;
+  // A histogram: for each pixel, the sum of the color indices of its hits
+  // (see palette.hpp) and the number of hits, of type `Counter` (see
+  // counters.hpp).
+  template<typename Counter = uint32_t>
+  using raw_image_data = image_data<double, Counter>;
+  template<typename Counter = uint32_t>
+  using raw_image_view = image_data_view<double, Counter>;
   template<typename ColorPixel>
   using cooked_image_data = image_data<ColorPixel, double>;
 
   namespace detail {
-    inline auto do_linear_alpha(const boost::gil::image<uint32_t, false> &src) {
-      using namespace boost::gil;
+    // Clamp a summed hit count to `Max`, scaling its color sum to keep the
+    // average.
+    template<uint64_t Max>
+    inline void saturate(double &color, uint64_t &alpha) {
+      if(alpha > Max) {
+        color *= static_cast<double>(Max) / alpha;
+        alpha = Max;
+      }
+    }
 
-      image<double, false> dst(src.dimensions(), 0, 0);
+    // Look up the average color index of every pixel in `palette`.
+    template<typename Counter, typename ColorPixel>
+    auto palette_colors(const raw_image_data<Counter> &src,
+                        const colors::palette<ColorPixel> &palette) {
+      using namespace boost::gil;
 
-      auto src_view = const_view(src);
+      image<ColorPixel, false> dst(src.dimensions(), ColorPixel(0), 0);
       auto dst_view = view(dst);
+      auto color = const_view(src.color);
+      auto alpha = src.alpha_view();
 
-      auto max_alpha = *std::max_element(src_view.begin(), src_view.end());
-      for(size_t i = 0; i != dst_view.size(); i++)
-        dst_view[i] = static_cast<double>(src_view[i]) / max_alpha;
+      for(size_t i = 0; i != dst_view.size(); i++) {
+        if(uint64_t n = alpha[i])
+          dst_view[i] = palette(color[i] / n);
+      }
       return dst;
     }
 
-    inline auto do_log_alpha(const boost::gil::image<uint32_t, false> &src) {
+    template<typename AlphaView>
+    uint64_t max_count(const AlphaView &alpha) {
+      uint64_t max = 0;
+      for(size_t i = 0; i != alpha.size(); i++)
+        max = std::max<uint64_t>(max, alpha[i]);
+      return max;
+    }
+
+    template<typename AlphaView>
+    auto do_linear_alpha(const AlphaView &src) {
       using namespace boost::gil;
 
       image<double, false> dst(src.dimensions(), 0, 0);
-
-      auto src_view = const_view(src);
       auto dst_view = view(dst);
 
-      auto max_alpha = *std::max_element(src_view.begin(), src_view.end());
-      auto logmax = std::log(static_cast<double>(max_alpha));
+      double max_alpha = max_count(src);
       for(size_t i = 0; i != dst_view.size(); i++)
-        dst_view[i] = std::log(static_cast<double>(src_view[i])) / logmax;
+        dst_view[i] = static_cast<uint64_t>(src[i]) / max_alpha;
       return dst;
     }
-  }
 
-  template<typename ColorPixel>
-  cooked_image_data<ColorPixel>
-  linear_alpha(const raw_image_data<ColorPixel> &src) {
-    return {src.color, detail::do_linear_alpha(src.alpha)};
-  }
+    template<typename AlphaView>
+    auto do_log_alpha(const AlphaView &src) {
+      using namespace boost::gil;
 
-  template<typename ColorPixel>
-  cooked_image_data<ColorPixel>
-  linear_alpha(raw_image_data<ColorPixel> &&src) {
-    return {std::move(src.color), detail::do_linear_alpha(src.alpha)};
+      image<double, false> dst(src.dimensions(), 0, 0);
+      auto dst_view = view(dst);
+
+      auto logmax = std::log(static_cast<double>(max_count(src)));
+      for(size_t i = 0; i != dst_view.size(); i++) {
+        dst_view[i] = std::log(static_cast<double>(
+          static_cast<uint64_t>(src[i])
+        )) / logmax;
+      }
+      return dst;
+    }
   }
 
-  template<typename ColorPixel>
+  template<typename Counter, typename ColorPixel>
   cooked_image_data<ColorPixel>
-  log_alpha(const raw_image_data<ColorPixel> &src) {
-    return {src.color, detail::do_log_alpha(src.alpha)};
+  linear_alpha(const raw_image_data<Counter> &src,
+               const colors::palette<ColorPixel> &palette) {
+    return {detail::palette_colors(src, palette),
+            detail::do_linear_alpha(src.alpha_view())};
   }
 
-  template<typename ColorPixel>
+  template<typename Counter, typename ColorPixel>
   cooked_image_data<ColorPixel>
-  log_alpha(raw_image_data<ColorPixel> &&src) {
-    return {std::move(src.color), detail::do_log_alpha(src.alpha)};
+  log_alpha(const raw_image_data<Counter> &src,
+            const colors::palette<ColorPixel> &palette) {
+    return {detail::palette_colors(src, palette),
+            detail::do_log_alpha(src.alpha_view())};
   }
 
   template<typename View, typename ColorPixel>
@@ -130,39 +194,89 @@ namespace images {
     }
   }
 
-  template<typename Pixel>
-  raw_image_data<Pixel>
-  combine(const std::vector<raw_image_data<Pixel>> &srcs) {
+  // Sum several histograms of the same size. A count too big for `Counter`
+  // is clamped to its maximum, with the color sum scaled to match, so the
+  // pixel keeps its average color.
+  template<typename Counter>
+  raw_image_data<Counter>
+  combine(const std::vector<raw_image_data<Counter>> &srcs) {
     using namespace boost::gil;
-    using image_data = raw_image_data<Pixel>;
+    using image_data = raw_image_data<Counter>;
+    using alpha_plane_t = alpha_plane<Counter>;
 
     assert(!srcs.empty());
     image_data dst(srcs[0].dimensions());
     auto dst_color_view = view(dst.color);
-    auto dst_alpha_view = view(dst.alpha);
+    auto dst_alpha_view = alpha_plane_t::make_view(dst.alpha);
 
     std::vector<typename image_data::color_image::const_view_t> src_color_views;
-    std::vector<typename image_data::alpha_image::const_view_t> src_alpha_views;
+    std::vector<typename alpha_plane_t::const_view> src_alpha_views;
     for(const auto &src : srcs) {
       src_color_views.push_back(const_view(src.color));
-      src_alpha_views.push_back(const_view(src.alpha));
+      src_alpha_views.push_back(src.alpha_view());
     }
 
     for(size_t px = 0; px != dst_color_view.size(); px++) {
-      for(const auto &alpha : src_alpha_views)
-        dst_alpha_view[px] += alpha[px];
-
+      double color = 0;
+      uint64_t alpha = 0;
       for(size_t s = 0; s != srcs.size(); s++) {
-        double weight = static_cast<double>(src_alpha_views[s][px]) /
-          dst_alpha_view[px];
-        for(size_t chan = 0; chan != boost::gil::size<Pixel>::value; chan++)
-          dst_color_view[px][chan] += src_color_views[s][px][chan] * weight;
+        color += src_color_views[s][px];
+        alpha += static_cast<uint64_t>(src_alpha_views[s][px]);
       }
+      detail::saturate<alpha_plane_t::max>(color, alpha);
+      dst_color_view[px] = color;
+      dst_alpha_view[px] = alpha;
     }
 
     return dst;
   }
 
+  // Merge several histograms of the same size into `dst`, summing their
+  // color indices and hit counts (saturating, like combine()). This works on
+  // views so that the inputs can be memory-mapped files; it streams through
+  // them a block of rows at a time, spreading blocks across `pool` if one is
+  // given.
+  template<typename Counter>
+  void merge(const std::vector<raw_image_view<Counter>> &srcs,
+             const raw_image_view<Counter> &dst,
+             parallel::thread_pool *pool = nullptr) {
+    using namespace boost::gil;
+    constexpr uint64_t max_alpha = alpha_plane<Counter>::max;
+
+    for(const auto &src : srcs)
+      assert(src.dimensions() == dst.dimensions());
+    const ptrdiff_t width = dst.dimensions().x;
+
+    parallel::for_each_block(pool, dst.dimensions().y, 16, [&](
+      size_t begin, size_t end
+    ) {
+      std::vector<uint64_t> alpha(width);
+      std::vector<double> color(width);
+
+      for(size_t y = begin; y != end; y++) {
+        std::fill(alpha.begin(), alpha.end(), 0);
+        std::fill(color.begin(), color.end(), 0.0);
+
+        for(const auto &src : srcs) {
+          auto c = src.color.row_begin(y);
+          auto a = src.alpha.row_begin(y);
+          for(ptrdiff_t x = 0; x != width; x++) {
+            color[x] += c[x];
+            alpha[x] += a[x];
+          }
+        }
+
+        auto c = dst.color.row_begin(y);
+        auto a = dst.alpha.row_begin(y);
+        for(ptrdiff_t x = 0; x != width; x++) {
+          detail::saturate<max_alpha>(color[x], alpha[x]);
+          c[x] = color[x];
+          a[x] = alpha[x];
+        }
+      }
+    });
+  }
+
   template<typename View, typename ConstView>
   void lighten(View &a, const ConstView &b) {
     using namespace boost::gil;
@@ -176,6 +290,233 @@ namespace images {
     }
   }
 
+  struct tone_map_options {
+    double gamma = 1.0;
+    std::optional<double> hdr;
+  };
+
+  namespace detail {
+    // A pixel's hit count as read from a `Counter`: whole hits for the
+    // integer counters, and fractional ones for filtered histograms.
+    template<typename Counter>
+    using count_type = std::conditional_t<
+      std::is_floating_point_v<Counter>, double, uint64_t
+    >;
+
+    template<typename Counter, typename AlphaView>
+    count_type<Counter> parallel_max(const AlphaView &alpha,
+                                     parallel::thread_pool *pool) {
+      using count_t = count_type<Counter>;
+      std::vector<count_t> maxes(alpha.height(), 0);
+      parallel::for_each_block(pool, alpha.height(), 64, [&](
+        size_t begin, size_t end
+      ) {
+        for(size_t y = begin; y != end; y++) {
+          auto row = alpha.row_begin(y);
+          count_t max = 0;
+          for(ptrdiff_t x = 0; x != alpha.width(); x++)
+            max = std::max<count_t>(max, row[x]);
+          maxes[y] = max;
+        }
+      });
+      return maxes.empty() ? 0 : *std::max_element(maxes.begin(), maxes.end());
+    }
+
+    // Lookup tables for the per-count factors used by tone_map: the
+    // log-scaled, gamma-corrected brightness and the linear HDR highlight.
+    // Only small whole counts are tabulated; anything larger, or fractional,
+    // is computed directly.
+    //
+    // Whole counts are scaled by log(n), as flam3 does, so a lone hit is
+    // black. A `fractional` histogram (one spread out by a filter) is scaled
+    // by log(1 + n) instead: its sparse regions are made of counts well
+    // below one, which log(n) would turn black along with the noise.
+    class tone_curve {
+    public:
+      static constexpr size_t max_table_size = 1 << 16;
+
+      tone_curve(double max_alpha, const tone_map_options &opts,
+                 parallel::thread_pool *pool, bool fractional = false)
+        : fractional_(fractional),
+          max_alpha_(fractional ? max_alpha : std::max(max_alpha, 1.0)),
+          log_max_(log_count(max_alpha_)),
+          inv_gamma_(1 / opts.gamma),
+          inv_hdr_(opts.hdr ? std::optional(1 / *opts.hdr) : std::nullopt),
+          brightness_(std::min<uint64_t>(max_alpha_ + 1, max_table_size)),
+          highlight_(inv_hdr_ ? brightness_.size() : 0) {
+        parallel::for_each_block(pool, brightness_.size(), 4096, [&](
+          size_t begin, size_t end
+        ) {
+          for(size_t n = begin; n != end; n++) {
+            brightness_[n] = compute_brightness(n);
+            if(inv_hdr_)
+              highlight_[n] = compute_highlight(n);
+          }
+        });
+      }
+
+      inline bool hdr() const {
+        return inv_hdr_.has_value();
+      }
+
+      inline float brightness(uint64_t n) const {
+        return n < brightness_.size() ? brightness_[n] : compute_brightness(n);
+      }
+
+      inline float highlight(uint64_t n) const {
+        return n < highlight_.size() ? highlight_[n] : compute_highlight(n);
+      }
+
+      inline float brightness(double n) const {
+        return compute_brightness(n);
+      }
+
+      inline float highlight(double n) const {
+        return compute_highlight(n);
+      }
+    private:
+      inline double log_count(double n) const {
+        return fractional_ ? std::log1p(n) : std::log(n);
+      }
+
+      float compute_brightness(double n) const {
+        if(n == 0)
+          return 0;
+        double a = log_max_ > 0 ? std::max(log_count(n), 0.0) / log_max_ : 1;
+        return static_cast<float>(std::pow(a, inv_gamma_));
+      }
+
+      float compute_highlight(double n) const {
+        return static_cast<float>(std::pow(n / max_alpha_, *inv_hdr_));
+      }
+
+      bool fractional_;
+      double max_alpha_;
+      double log_max_, inv_gamma_;
+      std::optional<double> inv_hdr_;
+      std::vector<float> brightness_, highlight_;
+    };
+  }
+
+  // Turn a histogram into displayable pixels one row at a time: look up
+  // each pixel's average color index in the palette, log-scale the hit
+  // counts, apply gamma, scale the colors, and (with HDR) lighten with a
+  // gamma-corrected linear highlight. This is equivalent to render() on
+  // log_alpha() followed by lighten() with render_monochrome() on
+  // linear_alpha() to within one step of an 8-bit channel (the curve is
+  // tabulated in float, and lighten() works on images already rounded to 8
+  // bits), but touches each pixel once and keeps no intermediate images.
+  // Everything is computed in floating point and only quantized to the
+  // output's channel type at the end, so rows can be mapped to 8-bit, 16-bit
+  // or float pixels alike.
+  template<typename ColorPixel, typename Counter = uint32_t>
+  class tone_mapper {
+  public:
+    tone_mapper(const raw_image_data<Counter> &src,
+                const colors::palette<ColorPixel> &palette,
+                const tone_map_options &opts = {},
+                parallel::thread_pool *pool = nullptr)
+      : color_(const_view(src.color)), alpha_(src.alpha_view()),
+        palette_(palette), entries_(normalize(palette)),
+        curve_(detail::parallel_max<Counter>(alpha_, pool), opts, pool,
+               std::is_floating_point_v<Counter>) {}
+
+    tone_mapper(const raw_image_view<Counter> &src,
+                const colors::palette<ColorPixel> &palette,
+                const tone_map_options &opts = {},
+                parallel::thread_pool *pool = nullptr)
+      : color_(src.color), alpha_(src.alpha), palette_(palette),
+        entries_(normalize(palette)),
+        curve_(detail::parallel_max<Counter>(alpha_, pool), opts, pool,
+               std::is_floating_point_v<Counter>) {}
+
+    auto dimensions() const {
+      return color_.dimensions();
+    }
+
+    template<typename OutIter>
+    void map_row(ptrdiff_t y, OutIter out) const {
+      using namespace boost::gil;
+      using dst_pixel = typename std::iterator_traits<OutIter>::value_type;
+      using channel_t = typename channel_type<dst_pixel>::type;
+      constexpr size_t channels = boost::gil::size<dst_pixel>::value;
+      static_assert(channels <= palette_channels,
+                    "the palette has too few channels for this output");
+      const float max = channel_traits<channel_t>::max_value();
+
+      auto c = color_.row_begin(y);
+      auto a = alpha_.row_begin(y);
+
+      // Work through the row in blocks: first gather each pixel's factors
+      // and palette entry (table lookups, which don't vectorize), then run
+      // the arithmetic over each channel with simd::tone().
+      float b[block], h[block], v[channels][block];
+      for(ptrdiff_t x0 = 0; x0 < color_.width(); x0 += block) {
+        const ptrdiff_t len = std::min<ptrdiff_t>(block, color_.width() - x0);
+        for(ptrdiff_t i = 0; i != len; i++) {
+          detail::count_type<Counter> n = a[x0 + i];
+          b[i] = n ? curve_.brightness(n) : 0;
+          h[i] = n && curve_.hdr() ? curve_.highlight(n) : 0;
+          const auto &color = entries_[n ? palette_.lookup(c[x0 + i] / n) : 0];
+          for(size_t chan = 0; chan != channels; chan++)
+            v[chan][i] = color[chan];
+        }
+
+        for(size_t chan = 0; chan != channels; chan++)
+          simd::tone(v[chan], b, h, max, len);
+
+        for(ptrdiff_t i = 0; i != len; i++) {
+          for(size_t chan = 0; chan != channels; chan++)
+            out[x0 + i][chan] = static_cast<channel_t>(v[chan][i]);
+        }
+      }
+    }
+  private:
+    static constexpr size_t palette_channels =
+      boost::gil::size<ColorPixel>::value;
+    static constexpr ptrdiff_t block = 256;
+    using entry = std::array<float, palette_channels>;
+
+    // The palette's entries, scaled to [0, 1].
+    static std::vector<entry>
+    normalize(const colors::palette<ColorPixel> &palette) {
+      using namespace boost::gil;
+      using channel_t = typename channel_type<ColorPixel>::type;
+      const float max = channel_traits<channel_t>::max_value();
+
+      std::vector<entry> entries(palette.size());
+      for(size_t i = 0; i != palette.size(); i++) {
+        for(size_t chan = 0; chan != palette_channels; chan++)
+          entries[i][chan] = palette[i][chan] / max;
+      }
+      return entries;
+    }
+
+    typename raw_image_data<Counter>::color_image::const_view_t color_;
+    typename alpha_plane<Counter>::const_view alpha_;
+    colors::palette<ColorPixel> palette_;
+    std::vector<entry> entries_;
+    detail::tone_curve curve_;
+  };
+
+  // Tone map a whole histogram into `dst`, splitting rows across `pool` if
+  // one is given.
+  template<typename View, typename Counter, typename ColorPixel>
+  void tone_map(const View &dst, const raw_image_data<Counter> &src,
+                const colors::palette<ColorPixel> &palette,
+                const tone_map_options &opts = {},
+                parallel::thread_pool *pool = nullptr) {
+    tone_mapper<ColorPixel, Counter> mapper(src, palette, opts, pool);
+    assert(dst.dimensions() == mapper.dimensions());
+
+    parallel::for_each_block(pool, dst.height(), 16, [&](
+      size_t begin, size_t end
+    ) {
+      for(size_t y = begin; y != end; y++)
+        mapper.map_row(y, dst.row_begin(y));
+    });
+  }
+
 } // namespace images
 
 #endif
@@ -0,0 +1,127 @@
+#ifndef INC_MUSPELHEIM_PALETTE_HPP
+#define INC_MUSPELHEIM_PALETTE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/gil/channel.hpp>
+#include <boost/gil/pixel.hpp>
+
+#include "colors.hpp"
+
+namespace colors {
+
+  // Interpolate linearly from `a` (at t = 0) to `b` (at t = 1). Integral
+  // channels are rounded, so that mixing equal colors gives that color.
+  template<typename Pixel>
+  Pixel mix(const Pixel &a, const Pixel &b, double t) {
+    using channel_type = typename boost::gil::channel_type<Pixel>::type;
+
+    Pixel result;
+    for(size_t chan = 0; chan != boost::gil::size<Pixel>::value; chan++) {
+      double v = a[chan] * (1 - t) + b[chan] * t;
+      if constexpr(std::is_integral_v<channel_type>)
+        v = std::round(v);
+      result[chan] = static_cast<channel_type>(v);
+    }
+    return result;
+  }
+
+  // A color lookup table for flam3-style coloring. Every hit carries a color
+  // index in [0, 1]; the histogram sums these per pixel, and the average
+  // index picks the pixel's color from the table when tone mapping.
+  template<typename Pixel>
+  class palette {
+  public:
+    using pixel_type = Pixel;
+    using channel_type = typename boost::gil::channel_type<Pixel>::type;
+    using stop = std::pair<double, Pixel>;
+
+    static constexpr size_t default_size = 256;
+
+    palette() : palette(std::vector<Pixel>{Pixel(0)}) {}
+
+    explicit palette(std::vector<Pixel> entries)
+      : entries_(std::move(entries)) {
+      assert(!entries_.empty());
+    }
+
+    // Interpolate linearly between `stops`, each a position in [0, 1] and a
+    // color. Before the first stop and after the last, the ends are held.
+    static palette gradient(std::vector<stop> stops,
+                            size_t size = default_size) {
+      assert(!stops.empty() && size > 0);
+      std::stable_sort(stops.begin(), stops.end(), [](
+        const stop &a, const stop &b
+      ) {
+        return a.first < b.first;
+      });
+
+      std::vector<Pixel> entries(size);
+      size_t s = 0;
+      for(size_t i = 0; i != size; i++) {
+        double pos = size > 1 ? static_cast<double>(i) / (size - 1) : 0;
+        while(s + 1 < stops.size() && stops[s + 1].first <= pos)
+          s++;
+
+        const auto &lo = stops[s];
+        if(pos <= lo.first || s + 1 == stops.size()) {
+          entries[i] = lo.second;
+          continue;
+        }
+        const auto &hi = stops[s + 1];
+        double t = (pos - lo.first) / (hi.first - lo.first);
+        entries[i] = mix(lo.second, hi.second, t);
+      }
+      return palette(std::move(entries));
+    }
+
+    // A gradient through the first `count` colors of the theme around
+    // `base`, spaced evenly.
+    static palette theme(const rgb &base, int16_t spread = 10,
+                         size_t count = 8, size_t size = default_size) {
+      assert(count > 0);
+      std::vector<stop> stops;
+      color_theme_iterator color(base, spread);
+      for(size_t i = 0; i != count; i++, ++color) {
+        double pos = count > 1 ? static_cast<double>(i) / (count - 1) : 0;
+        stops.emplace_back(pos, Pixel(color->r, color->g, color->b));
+      }
+      return gradient(std::move(stops), size);
+    }
+
+    inline size_t size() const {
+      return entries_.size();
+    }
+
+    inline const std::vector<Pixel> & entries() const {
+      return entries_;
+    }
+
+    inline const Pixel & operator [](size_t i) const {
+      return entries_[i];
+    }
+
+    // The entry for `index`, clamping it to [0, 1].
+    inline size_t lookup(double index) const {
+      double i = index * entries_.size();
+      if(!(i > 0))
+        return 0;
+      return std::min(static_cast<size_t>(i), entries_.size() - 1);
+    }
+
+    inline const Pixel & operator ()(double index) const {
+      return entries_[lookup(index)];
+    }
+  private:
+    std::vector<Pixel> entries_;
+  };
+
+} // namespace colors
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef INC_MUSPELHEIM_PFM_WRITER_HPP
+#define INC_MUSPELHEIM_PFM_WRITER_HPP
+
+#include <memory>
+#include <string>
+
+#include <boost/gil/typedefs.hpp>
+
+#include "images.hpp"
+#include "row_stream.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace images {
+
+  // Write a color Portable Float Map (32-bit float RGB in [0, 1], with no
+  // quantization) a block of rows at a time. The pixels are whatever they
+  // are given: write_pfm() passes tone-mapped ones, log-scaled and gamma
+  // corrected, not linear. Rows are passed top to bottom, even though PFM
+  // stores them bottom to top.
+  class pfm_writer {
+  public:
+    pfm_writer(const std::string &filename, size_t width, size_t height);
+    ~pfm_writer();
+
+    pfm_writer(const pfm_writer &) = delete;
+    pfm_writer & operator =(const pfm_writer &) = delete;
+
+    // Write `count` tightly-packed rows of float RGB pixels.
+    void write_rows(const float *rows, size_t count);
+    void finish();
+  private:
+    struct state;
+    std::unique_ptr<state> state_;
+  };
+
+  // Stream the output of `mapper` out as a PFM; see detail::stream_rows().
+  template<typename ColorPixel, typename Counter>
+  void write_pfm(const std::string &filename,
+                 const tone_mapper<ColorPixel, Counter> &mapper,
+                 parallel::thread_pool *pool = nullptr,
+                 stats::timings *timings = nullptr, size_t block_rows = 64) {
+    using pixel = boost::gil::rgb32f_pixel_t;
+    static_assert(sizeof(pixel) == 3 * sizeof(float),
+                  "rgb32f pixels must be tightly packed");
+
+    auto dims = mapper.dimensions();
+    pfm_writer writer(filename, dims.x, dims.y);
+    detail::stream_rows<pixel>(mapper, [&](const pixel *rows, size_t count) {
+      writer.write_rows(reinterpret_cast<const float*>(rows), count);
+    }, pool, timings, "pfm_write", block_rows);
+
+    auto start = stats::clock::now();
+    writer.finish();
+    if(timings)
+      timings->add("pfm_write", stats::clock::now() - start);
+  }
+
+} // namespace images
+
+#endif
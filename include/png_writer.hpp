@@ -0,0 +1,98 @@
+#ifndef INC_MUSPELHEIM_PNG_WRITER_HPP
+#define INC_MUSPELHEIM_PNG_WRITER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/gil/typedefs.hpp>
+
+#include "images.hpp"
+#include "row_stream.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace images {
+
+  // Write an 8- or 16-bit RGB PNG a block of rows at a time, so that the
+  // whole image never needs to be in memory at once.
+  class png_writer {
+  public:
+    png_writer(const std::string &filename, size_t width, size_t height,
+               int bit_depth = 8);
+    ~png_writer();
+
+    png_writer(const png_writer &) = delete;
+    png_writer & operator =(const png_writer &) = delete;
+
+    // Write `count` tightly-packed rows of RGB pixels, with channels of
+    // `bit_depth` bits in native byte order.
+    void write_rows(const void *rows, size_t count);
+    void finish();
+  private:
+    struct state;
+    std::unique_ptr<state> state_;
+  };
+
+  // Stream the output of `mapper` out as a PNG with `bit_depth` (8 or 16)
+  // bits per channel; see detail::stream_rows().
+  template<typename ColorPixel, typename Counter>
+  void write_png(const std::string &filename,
+                 const tone_mapper<ColorPixel, Counter> &mapper,
+                 parallel::thread_pool *pool = nullptr,
+                 stats::timings *timings = nullptr, int bit_depth = 8,
+                 size_t block_rows = 64) {
+    using namespace boost::gil;
+    static_assert(sizeof(rgb8_pixel_t) == 3 && sizeof(rgb16_pixel_t) == 6,
+                  "rgb pixels must be tightly packed");
+
+    auto dims = mapper.dimensions();
+    png_writer writer(filename, dims.x, dims.y, bit_depth);
+    auto write = [&](const auto *rows, size_t count) {
+      writer.write_rows(rows, count);
+    };
+    if(bit_depth == 16) {
+      detail::stream_rows<rgb16_pixel_t>(mapper, write, pool, timings,
+                                         "png_encode", block_rows);
+    } else {
+      detail::stream_rows<rgb8_pixel_t>(mapper, write, pool, timings,
+                                        "png_encode", block_rows);
+    }
+
+    auto start = stats::clock::now();
+    writer.finish();
+    if(timings)
+      timings->add("png_encode", stats::clock::now() - start);
+  }
+
+  template<typename Counter, typename ColorPixel>
+  void write_png(const std::string &filename,
+                 const raw_image_data<Counter> &src,
+                 const colors::palette<ColorPixel> &palette,
+                 const tone_map_options &opts = {},
+                 parallel::thread_pool *pool = nullptr,
+                 stats::timings *timings = nullptr, int bit_depth = 8) {
+    auto start = stats::clock::now();
+    tone_mapper<ColorPixel, Counter> mapper(src, palette, opts, pool);
+    if(timings)
+      timings->add("tone_map", stats::clock::now() - start);
+    write_png(filename, mapper, pool, timings, bit_depth);
+  }
+
+  template<typename Counter, typename ColorPixel>
+  void write_png(const std::string &filename,
+                 const raw_image_view<Counter> &src,
+                 const colors::palette<ColorPixel> &palette,
+                 const tone_map_options &opts = {},
+                 parallel::thread_pool *pool = nullptr,
+                 stats::timings *timings = nullptr, int bit_depth = 8) {
+    auto start = stats::clock::now();
+    tone_mapper<ColorPixel, Counter> mapper(src, palette, opts, pool);
+    if(timings)
+      timings->add("tone_map", stats::clock::now() - start);
+    write_png(filename, mapper, pool, timings, bit_depth);
+  }
+
+} // namespace images
+
+#endif
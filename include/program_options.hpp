@@ -0,0 +1,33 @@
+#ifndef INC_MUSPELHEIM_PROGRAM_OPTIONS_HPP
+#define INC_MUSPELHEIM_PROGRAM_OPTIONS_HPP
+
+#include <cassert>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+// Put this in the boost namespace so that ADL picks them up (via the
+// boost::any parameter).
+namespace boost {
+
+  template<typename T>
+  void validate(boost::any &v, const std::vector<std::string> &values,
+                std::optional<T>*, int) {
+    using namespace boost::program_options;
+    using optional_t = std::optional<T>;
+
+    if(v.empty())
+      v = optional_t();
+    auto *val = boost::any_cast<optional_t>(&v);
+    assert(val);
+
+    boost::any a;
+    validate(a, values, static_cast<T*>(nullptr), 0);
+    *val = boost::any_cast<T>(a);
+  }
+
+} // namespace boost
+
+#endif
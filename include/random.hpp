@@ -0,0 +1,100 @@
+#ifndef INC_MUSPELHEIM_RANDOM_HPP
+#define INC_MUSPELHEIM_RANDOM_HPP
+
+#include <cstdint>
+#include <limits>
+#include <random>
+
+namespace rng {
+
+  // The SplitMix64 finalizer: a bijective mix of all 64 bits. Good for
+  // turning related seeds (e.g. a seed plus a stream number) into
+  // unrelated ones.
+  inline constexpr uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  // xoshiro256++ (Blackman and Vigna): a small, fast generator with 256 bits
+  // of state. Each (seed, stream) pair is expanded into its own state with
+  // SplitMix64, so streams can be handed out to chunks of work without any
+  // coordination and reproduced later.
+  class xoshiro256pp {
+  public:
+    using result_type = uint64_t;
+
+    explicit xoshiro256pp(uint64_t seed = 0, uint64_t stream = 0) {
+      uint64_t z = mix(seed) ^ mix(stream + 0x9e3779b97f4a7c15ull);
+      for(auto &s : s_)
+        s = mix(z += 0x9e3779b97f4a7c15ull);
+    }
+
+    static constexpr result_type min() {
+      return 0;
+    }
+
+    static constexpr result_type max() {
+      return std::numeric_limits<result_type>::max();
+    }
+
+    inline result_type operator ()() {
+      uint64_t result = rotl(s_[0] + s_[3], 23) + s_[0];
+      uint64_t t = s_[1] << 17;
+
+      s_[2] ^= s_[0];
+      s_[3] ^= s_[1];
+      s_[1] ^= s_[2];
+      s_[0] ^= s_[3];
+      s_[2] ^= t;
+      s_[3] = rotl(s_[3], 45);
+
+      return result;
+    }
+  private:
+    static inline uint64_t rotl(uint64_t x, int k) {
+      return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t s_[4];
+  };
+
+  // 64 uniformly random bits from `engine`. Full-range 64-bit engines are
+  // used directly; anything else goes through the standard library.
+  template<typename Engine>
+  inline uint64_t bits(Engine &engine) {
+    if constexpr(Engine::min() == 0 &&
+                 Engine::max() == std::numeric_limits<uint64_t>::max()) {
+      return engine();
+    } else {
+      return std::uniform_int_distribution<uint64_t>()(engine);
+    }
+  }
+
+  // A uniformly random double in [0, 1). Unlike the standard distributions,
+  // this gives the same results with every standard library.
+  template<typename Engine>
+  inline double canonical(Engine &engine) {
+    return (bits(engine) >> 11) * 0x1.0p-53;
+  }
+
+  // Scale 64 random bits `x` to [0, n): the high half of x * n is a nearly
+  // uniform index and the low half is the fraction left over (Lemire).
+  inline uint64_t scale(uint64_t x, uint64_t n, uint64_t &fraction) {
+#ifdef __SIZEOF_INT128__
+    auto product = static_cast<unsigned __int128>(x) * n;
+    fraction = static_cast<uint64_t>(product);
+    return static_cast<uint64_t>(product >> 64);
+#else
+    // Split x into 32-bit halves and do the long multiplication by hand.
+    // This assumes n fits in 32 bits.
+    uint64_t lo = (x & 0xffffffff) * n, hi = (x >> 32) * n;
+    uint64_t mid = (lo >> 32) + (hi & 0xffffffff);
+    fraction = (mid << 32) | (lo & 0xffffffff);
+    return (hi >> 32) + (mid >> 32);
+#endif
+  }
+
+} // namespace rng
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef INC_MUSPELHEIM_RENDER_HPP
+#define INC_MUSPELHEIM_RENDER_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "histogram.hpp"
+#include "ifs.hpp"
+#include "random.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace ifs {
+
+  // How much work a render may do. The render stops once it has run `steps`
+  // iterations, `time` has elapsed, or the density has converged to within
+  // `tolerance`, whichever comes first.
+  struct render_budget {
+    using clock = std::chrono::steady_clock;
+    static constexpr size_t unlimited = std::numeric_limits<size_t>::max();
+
+    size_t steps = unlimited;
+    std::optional<clock::duration> time;
+
+    // The most iterations a stream runs at once. A budget of `steps` too
+    // small to give every stream `min_rounds` chunks of this size is split
+    // into smaller chunks, so that every thread still gets a share.
+    size_t chunk_size = 1 << 20;
+    size_t min_rounds = 4;
+
+    // If set, pause this often so that everything plotted so far can be
+    // saved; see render().
+    std::optional<clock::duration> checkpoint_interval;
+
+    // The seed for the random streams. With the same seed, step count, chunk
+    // size and number of threads, a render always produces the same
+    // histogram.
+    uint64_t seed = 0;
+
+    // If set, stop once the estimated error of the normalized density
+    // (see render()) falls below this. The density is tracked in cells of
+    // `convergence_cell` pixels square, which keeps the estimate cheap;
+    // smaller cells make it more sensitive to fine detail. A render that
+    // lands no hits at all for `max_empty_rounds` rounds in a row (say, the
+    // camera is pointed away from the flame) can't converge, so it stops
+    // then too.
+    std::optional<double> tolerance;
+    ptrdiff_t convergence_cell = 4;
+    size_t max_empty_rounds = 16;
+  };
+
+  // Run the budget on `pool` in rounds, with every worker plotting into
+  // `dst`. Returns the number of iterations actually run.
+  //
+  // Each of the pool's threads gets its own random stream and batch of
+  // walkers. In every round, each stream runs one chunk and keeps its hits,
+  // grouped by band; then the bands are plotted in parallel, applying the
+  // streams' hits in stream order. Nothing depends on which thread ran what
+  // or when, so the result is reproducible (unless the render is stopped by
+  // `budget.time`, of course).
+  //
+  // Every `budget.checkpoint_interval` (rounded up to a whole round), and at
+  // the end, `checkpoint` is called with the number of iterations run so
+  // far; `dst`'s planes then hold exactly that many iterations' worth of
+  // hits.
+  //
+  // With `budget.tolerance`, every round also measures how far it moved the
+  // normalized density: the L1 distance between the cells' share of all hits
+  // before and after. Each chunk counts its own hits per cell as it goes, so
+  // this only costs a pass over the (small) cell grid per round. For a
+  // converging render, that change scaled by sqrt(N/K) (for N hits so far
+  // and K in the round) estimates the L1 error of the density itself,
+  // whatever the size of the rounds; the render stops once it falls below
+  // the tolerance. (That's also reproducible, since it only depends on the
+  // hits.)
+  //
+  // The canvas is viewed through `funcs.camera()`. If `dst` is one tile of a
+  // larger canvas (see shared_image_data::set_canvas()), only that tile's
+  // hits are kept. The streams don't depend on the tile, so rendering every
+  // tile with the same seed, step count and number of threads gives exactly
+  // the hits of rendering the whole canvas at once.
+  //
+  // The walkers iterate in `Real` and `precision` (see walker_batch).
+  //
+  // If `thread_stats` is given, it's filled with one set of counters per
+  // stream.
+  //
+  // Throws std::length_error if `dst` has more than 2^32 slots (see
+  // shared_image_data::capacity()).
+  template<typename Real = double, typename Pixel, typename Counter>
+  size_t render(const iterated_function_system<Pixel> &funcs,
+                images::shared_image_data<Counter> &dst,
+                parallel::thread_pool &pool, const render_budget &budget,
+                const std::function<void(size_t)> &checkpoint = {},
+                std::vector<stats::counters> *thread_stats = nullptr,
+                math::precision precision = math::precision::exact) {
+    using clock = render_budget::clock;
+    using namespace boost::gil;
+
+    assert(budget.chunk_size > 0 && budget.min_rounds > 0);
+    assert(budget.steps != render_budget::unlimited || budget.time ||
+           budget.tolerance);
+
+    const auto dims = dst.dimensions();
+    const auto to_canvas = funcs.camera().to_canvas(dst.canvas_dimensions());
+    const ptrdiff_t cell = budget.convergence_cell;
+    const size_t cell_cols = budget.tolerance ? (dims.x + cell - 1) / cell : 0;
+    const size_t cells = budget.tolerance ?
+      cell_cols * ((dims.y + cell - 1) / cell) : 0;
+    // Hits are queued with 32-bit indices; bigger canvases have to be
+    // rendered in tiles.
+    if(dst.capacity() > uint64_t(std::numeric_limits<uint32_t>::max()) + 1)
+      throw std::length_error("histogram too large to render at once; "
+                              "render it in tiles");
+
+    struct hit {
+      uint32_t index;
+      float color;
+    };
+
+    struct stream {
+      stream(const iterated_function_system<Pixel> &funcs,
+             math::precision precision, uint64_t seed, size_t index,
+             size_t bands, size_t cells)
+        : engine(seed, index), walkers(funcs, precision),
+          counters(funcs.size()),
+          hits(bands), cell_hits(cells) {
+        walkers.seed(engine);
+      }
+
+      rng::xoshiro256pp engine;
+      walker_batch<Pixel, Real> walkers;
+      stats::counters counters;
+      std::vector<std::vector<hit>> hits;
+      std::vector<uint32_t> cell_hits; // this round's hits in each cell
+      size_t steps = 0;
+    };
+
+    std::vector<stream> streams;
+    streams.reserve(pool.size());
+    for(size_t i = 0; i != pool.size(); i++)
+      streams.emplace_back(funcs, precision, budget.seed, i, dst.bands(),
+                           cells);
+
+    // The hits in each convergence cell so far, and their total, starting
+    // with anything already in `dst`.
+    std::vector<uint64_t> density(cells);
+    uint64_t total_hits = 0;
+    if(cells) {
+      const auto &alpha = dst.view().alpha;
+      for(ptrdiff_t y = 0; y != dims.y; y++) {
+        auto row = alpha.row_begin(y);
+        for(ptrdiff_t x = 0; x != dims.x; x++)
+          density[(y / cell) * cell_cols + x / cell] += row[x];
+      }
+      for(auto n : density)
+        total_hits += n;
+    }
+
+    // Fold this round's cell counts into `density`, returning whether the
+    // estimated error is now within tolerance (or there's nothing to
+    // converge on).
+    size_t empty_rounds = 0;
+    auto converged = [&]() {
+      uint64_t round_hits = 0;
+      for(size_t c = 0; c != cells; c++) {
+        for(const auto &s : streams)
+          round_hits += s.cell_hits[c];
+      }
+
+      double change = 0;
+      const double before = total_hits, after = total_hits + round_hits;
+      for(size_t c = 0; c != cells; c++) {
+        uint64_t n = density[c];
+        for(auto &s : streams) {
+          density[c] += s.cell_hits[c];
+          s.cell_hits[c] = 0;
+        }
+        if(total_hits)
+          change += std::abs(density[c] / after - n / before);
+      }
+
+      bool first = total_hits == 0;
+      total_hits += round_hits;
+      if(round_hits == 0)
+        return ++empty_rounds >= budget.max_empty_rounds;
+      empty_rounds = 0;
+      if(first)
+        return false;
+      return change * std::sqrt(before / round_hits) < *budget.tolerance;
+    };
+
+    auto deadline = budget.time ? std::optional(clock::now() + *budget.time)
+                                : std::nullopt;
+    auto next_checkpoint = [&]() -> std::optional<clock::time_point> {
+      if(!budget.checkpoint_interval)
+        return std::nullopt;
+      return clock::now() + *budget.checkpoint_interval;
+    };
+    auto pause = next_checkpoint();
+    size_t done = 0;
+
+    size_t chunk_size = budget.chunk_size;
+    if(budget.steps != render_budget::unlimited) {
+      const size_t shares = pool.size() * budget.min_rounds;
+      chunk_size = std::min(chunk_size, (budget.steps + shares - 1) / shares);
+      chunk_size = std::max<size_t>(chunk_size, 1);
+    }
+
+    for(;;) {
+      // Hand out this round's chunks in stream order.
+      size_t round = 0;
+      for(auto &s : streams) {
+        s.steps = std::min(chunk_size, budget.steps - done - round);
+        round += s.steps;
+      }
+
+      for(auto &s : streams) {
+        if(!s.steps)
+          continue;
+        pool.submit([&]() {
+          auto start = thread_stats ? clock::now() : clock::time_point();
+          chaos_game(s.walkers, s.engine, to_canvas, dst.origin(), dims,
+                     s.steps, [&](
+            const point2<ptrdiff_t> &pt, double c
+          ) {
+            s.hits[dst.band(pt)].push_back({
+              static_cast<uint32_t>(dst.index(pt)), static_cast<float>(c)
+            });
+            if(cells)
+              s.cell_hits[(pt.y / cell) * cell_cols + pt.x / cell]++;
+          }, thread_stats ? &s.counters : nullptr);
+          if(thread_stats)
+            s.counters.busy_time += clock::now() - start;
+        });
+      }
+      pool.wait();
+
+      // Each band is only touched by one task, so no locks are needed. Each
+      // stream is credited with the flushes of its own hits; tasks tally
+      // those locally and add them up once they're done.
+      std::mutex stats_lock;
+      parallel::for_each_block(&pool, dst.bands(), 1, [&](
+        size_t begin, size_t end
+      ) {
+        const size_t tallies = thread_stats ? streams.size() : 0;
+        std::vector<uint64_t> flushes(tallies);
+        std::vector<clock::duration> flush_time(tallies);
+        for(size_t b = begin; b != end; b++) {
+          for(size_t i = 0; i != streams.size(); i++) {
+            auto &hits = streams[i].hits[b];
+            if(hits.empty())
+              continue;
+            auto start = thread_stats ? clock::now() : clock::time_point();
+            for(const auto &h : hits)
+              dst.plot(h.index, h.color);
+            hits.clear();
+            if(thread_stats) {
+              flushes[i]++;
+              flush_time[i] += clock::now() - start;
+            }
+          }
+        }
+        if(thread_stats) {
+          std::lock_guard<std::mutex> lock(stats_lock);
+          for(size_t i = 0; i != streams.size(); i++) {
+            streams[i].counters.flushes += flushes[i];
+            streams[i].counters.flush_time += flush_time[i];
+          }
+        }
+      });
+      done += round;
+
+      auto now = clock::now();
+      bool finished = done == budget.steps || (deadline && now >= *deadline);
+      if(budget.tolerance && converged())
+        finished = true;
+      if(finished || (pause && now >= *pause)) {
+        if(checkpoint)
+          checkpoint(done);
+        pause = next_checkpoint();
+      }
+
+      if(finished) {
+        if(thread_stats) {
+          thread_stats->clear();
+          for(const auto &s : streams)
+            thread_stats->push_back(s.counters);
+        }
+        return done;
+      }
+    }
+  }
+
+} // namespace ifs
+
+#endif
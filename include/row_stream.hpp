@@ -0,0 +1,65 @@
+#ifndef INC_MUSPELHEIM_ROW_STREAM_HPP
+#define INC_MUSPELHEIM_ROW_STREAM_HPP
+
+#include <algorithm>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace images {
+
+  namespace detail {
+    // Tone map the rows of `mapper` into `OutPixel`s a block at a time and
+    // hand each block to `write(rows, count)`. Each block is mapped across
+    // `pool` while the previous one is written on another thread. If
+    // `timings` is given, the time spent on each is added to the "tone_map"
+    // and `write_stage` stages; since they overlap, they can add up to more
+    // than the wall-clock time.
+    template<typename OutPixel, typename Mapper, typename Write>
+    void stream_rows(const Mapper &mapper, Write &&write,
+                     parallel::thread_pool *pool, stats::timings *timings,
+                     const std::string &write_stage, size_t block_rows = 64) {
+      auto dims = mapper.dimensions();
+      std::vector<OutPixel> buffers[2] = {
+        std::vector<OutPixel>(block_rows * dims.x),
+        std::vector<OutPixel>(block_rows * dims.x)
+      };
+      std::future<void> pending;
+      stats::clock::duration map_time{}, write_time{};
+
+      size_t k = 0;
+      for(ptrdiff_t y = 0; y < dims.y; y += block_rows, k ^= 1) {
+        size_t rows = std::min<size_t>(block_rows, dims.y - y);
+        auto *buffer = buffers[k].data();
+        auto start = stats::clock::now();
+        parallel::for_each_block(pool, rows, 4, [&](size_t begin, size_t end) {
+          for(size_t r = begin; r != end; r++)
+            mapper.map_row(y + r, buffer + r * dims.x);
+        });
+        map_time += stats::clock::now() - start;
+
+        if(pending.valid())
+          pending.get();
+        pending = std::async(std::launch::async, [&, buffer, rows]() {
+          auto start = stats::clock::now();
+          write(static_cast<const OutPixel*>(buffer), rows);
+          write_time += stats::clock::now() - start;
+        });
+      }
+
+      if(pending.valid())
+        pending.get();
+
+      if(timings) {
+        timings->add("tone_map", map_time);
+        timings->add(write_stage, write_time);
+      }
+    }
+  }
+
+} // namespace images
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef INC_MUSPELHEIM_SIMD_HPP
+#define INC_MUSPELHEIM_SIMD_HPP
+
+#include <cstddef>
+
+#include "vec2d.hpp"
+
+namespace simd {
+
+  enum class instruction_set {
+    scalar,
+    sse2,
+    avx2
+  };
+
+  // The best instruction set supported by the CPU we're running on.
+  instruction_set detect();
+
+  // The instruction set the kernels below dispatch to. This is detect() by
+  // default, but can be lowered (e.g. to compare against the scalar path).
+  instruction_set active();
+  void set_active(instruction_set isa);
+
+  const char * name(instruction_set isa);
+
+  // Apply `t` in-place to `n` points stored as separate x and y lanes.
+  // Every instruction set rounds the same way, as (a*x + b*y) + c.
+  void affine(const math::affine_transform &t, double *x, double *y,
+              size_t n);
+  void affine(const math::basic_affine_transform<float> &t, float *x,
+              float *y, size_t n);
+
+  // Tone map `n` values of one channel in place: with v = value[i] *
+  // brightness[i], set value[i] = (v + (1 - v) * highlight[i]) * scale.
+  // Every instruction set rounds the same way, so the output doesn't
+  // depend on the CPU.
+  void tone(float *value, const float *brightness, const float *highlight,
+            float scale, size_t n);
+
+} // namespace simd
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef INC_MUSPELHEIM_STATS_HPP
+#define INC_MUSPELHEIM_STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace stats {
+
+  using clock = std::chrono::steady_clock;
+
+  // What one render thread did. Each thread updates its own copy without
+  // any synchronization; they're summed once the render is over.
+  struct counters {
+    counters() = default;
+    explicit counters(size_t functions) : picks(functions, 0) {}
+
+    counters & operator +=(const counters &rhs);
+
+    // Iterations run, and how many of those missed the canvas or produced a
+    // non-finite point (which also misses the canvas).
+    uint64_t iterations = 0, off_canvas = 0, non_finite = 0;
+
+    // How often each function was picked.
+    std::vector<uint64_t> picks;
+
+    // Batches of this thread's hits flushed into the shared histogram. In
+    // render(), that's one per band per round that the thread's stream had
+    // hits in, whichever thread did the flushing.
+    uint64_t flushes = 0;
+
+    // Time spent running chunks of the render, and time spent flushing this
+    // thread's hits into the histogram. render() flushes between rounds, so
+    // there the two don't overlap; a hit_buffer flushes in the middle of its
+    // thread's chunks, so its flush_time is also part of busy_time.
+    clock::duration busy_time{}, flush_time{};
+  };
+
+  // Wall-clock time spent in each stage of a render, in the order the
+  // stages were first recorded.
+  class timings {
+  public:
+    class scope {
+    public:
+      scope(timings &t, std::string name)
+        : timings_(t), name_(std::move(name)), start_(clock::now()) {}
+      scope(const scope &) = delete;
+      scope & operator =(const scope &) = delete;
+
+      ~scope() {
+        timings_.add(name_, clock::now() - start_);
+      }
+    private:
+      timings &timings_;
+      std::string name_;
+      clock::time_point start_;
+    };
+
+    void add(const std::string &name, clock::duration d);
+
+    // Time everything until the returned object goes out of scope.
+    inline scope time(std::string name) {
+      return scope(*this, std::move(name));
+    }
+
+    inline const std::vector<std::pair<std::string, clock::duration>> &
+    stages() const {
+      return stages_;
+    }
+  private:
+    std::vector<std::pair<std::string, clock::duration>> stages_;
+  };
+
+  // Write everything as a JSON object: the seed, the stage timings, the
+  // totals of `threads`, and each thread's own counters.
+  void write_json(std::ostream &os, uint64_t seed, const timings &t,
+                  const std::vector<counters> &threads);
+
+} // namespace stats
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef INC_MUSPELHEIM_SYMMETRY_HPP
+#define INC_MUSPELHEIM_SYMMETRY_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "vec2d.hpp"
+
+namespace ifs {
+
+  // A symmetry group about the center of a flame: the rotations by multiples
+  // of 2*pi/order, and if `reflect`, each of those after a mirror across the
+  // y axis (making it dihedral). Order 1 without reflection is the trivial
+  // group.
+  //
+  // A flame whose density is invariant under the group only needs to be
+  // sampled in one wedge: plotting every point along with its images gives
+  // the same density with 1/size() of the iterations.
+  struct symmetry {
+    size_t order = 1;
+    bool reflect = false;
+
+    inline size_t size() const {
+      return order * (reflect ? 2 : 1);
+    }
+
+    inline bool trivial() const {
+      return size() == 1;
+    }
+
+    // Every element of the group, starting with the identity.
+    std::vector<math::affine_transform> transforms() const {
+      std::vector<math::affine_transform> result;
+      for(size_t k = 0; k != order; k++)
+        result.push_back(math::rotate(2 * M_PI * k / order));
+      if(reflect) {
+        for(size_t k = 0; k != order; k++)
+          result.push_back(result[k] * mirror());
+      }
+      return result;
+    }
+
+    static math::affine_transform mirror() {
+      return { -1, 0, 0,
+                0, 1, 0 };
+    }
+
+    friend bool operator ==(const symmetry &lhs, const symmetry &rhs) {
+      return lhs.order == rhs.order && lhs.reflect == rhs.reflect;
+    }
+
+    friend bool operator !=(const symmetry &lhs, const symmetry &rhs) {
+      return !(lhs == rhs);
+    }
+  };
+
+  // Parse "none", "N" (N-fold rotation) or "dN" (N-fold with reflections).
+  inline std::optional<symmetry> parse_symmetry(const std::string &s) {
+    if(s == "none")
+      return symmetry{};
+
+    bool reflect = !s.empty() && s[0] == 'd';
+    std::string digits = s.substr(reflect ? 1 : 0);
+    if(digits.empty() || digits.size() > 6 ||
+       digits.find_first_not_of("0123456789") != std::string::npos)
+      return std::nullopt;
+    size_t order = std::stoul(digits);
+    if(order == 0)
+      return std::nullopt;
+    return symmetry{order, reflect};
+  }
+
+  // The inverse of parse_symmetry().
+  inline std::string to_string(const symmetry &sym) {
+    if(sym.trivial())
+      return "none";
+    return (sym.reflect ? "d" : "") + std::to_string(sym.order);
+  }
+
+  namespace detail {
+    inline bool nearly_equal(const math::affine_transform &x,
+                             const math::affine_transform &y,
+                             double tolerance) {
+      for(double d : {x.a - y.a, x.b - y.b, x.c - y.c,
+                      x.d - y.d, x.e - y.e, x.f - y.f}) {
+        if(!(std::abs(d) <= tolerance))
+          return false;
+      }
+      return true;
+    }
+
+    // True if conjugating every function of `funcs` by `g` (an isometry
+    // fixing the origin) gives back the same system: each function must
+    // map to one with the same weight and coloring, and the xaos matrix
+    // must be unchanged by the resulting permutation.
+    template<typename System>
+    bool invariant(const System &funcs, const math::affine_transform &g,
+                   const math::affine_transform &g_inverse,
+                   bool uniform_palette, double tolerance) {
+      std::vector<size_t> image(funcs.size());
+      for(size_t i = 0; i != funcs.size(); i++) {
+        auto conjugate = g * funcs[i].composite() * g_inverse;
+        auto match = std::find_if(funcs.begin(), funcs.end(), [&](
+          const auto &f
+        ) {
+          return nearly_equal(conjugate, f.composite(), tolerance) &&
+            f.weight() == funcs[i].weight() && (
+              uniform_palette || f.color_index() == funcs[i].color_index()
+            );
+        });
+        if(match == funcs.end())
+          return false;
+        image[i] = match - funcs.begin();
+      }
+
+      const auto &xaos = funcs.xaos();
+      for(size_t i = 0; i != xaos.size(); i++) {
+        for(size_t j = 0; j != xaos.size(); j++) {
+          if(xaos[i][j] != xaos[image[i]][image[j]])
+            return false;
+        }
+      }
+      return true;
+    }
+  }
+
+  // Find the largest symmetry group (up to `max_order`-fold) that `funcs`
+  // is invariant under. Only systems of linear functions are considered,
+  // since a variation's own symmetry is generally unknown; anything else
+  // gets the trivial group.
+  template<typename System>
+  symmetry detect_symmetry(const System &funcs, size_t max_order = 24,
+                           double tolerance = 1e-9) {
+    if(funcs.empty())
+      return {};
+    for(const auto &f : funcs) {
+      if(!f.linear())
+        return {};
+    }
+
+    const auto palette = funcs.palette();
+    const auto &entries = palette.entries();
+    bool uniform = std::all_of(entries.begin(), entries.end(), [&](
+      const auto &p
+    ) {
+      return p == entries.front();
+    });
+
+    const auto mirror = symmetry::mirror();
+    bool reflect = detail::invariant(funcs, mirror, mirror, uniform,
+                                     tolerance);
+    for(size_t order = max_order; order > 1; order--) {
+      double theta = 2 * M_PI / order;
+      if(detail::invariant(funcs, math::rotate(theta), math::rotate(-theta),
+                           uniform, tolerance))
+        return {order, reflect};
+    }
+    return {1, reflect};
+  }
+
+} // namespace ifs
+
+#endif
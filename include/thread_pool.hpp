@@ -0,0 +1,91 @@
+#ifndef INC_MUSPELHEIM_THREAD_POOL_HPP
+#define INC_MUSPELHEIM_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+  // A fixed-size pool of threads, each with its own task queue. Tasks
+  // submitted from a worker go to the back of that worker's queue; idle
+  // workers take from the back of their own queue first and then steal from
+  // the front of everyone else's.
+  class thread_pool {
+  public:
+    using task = std::function<void()>;
+    static constexpr size_t no_worker = static_cast<size_t>(-1);
+
+    explicit thread_pool(size_t threads = default_size());
+    ~thread_pool();
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool & operator =(const thread_pool &) = delete;
+
+    static size_t default_size();
+
+    inline size_t size() const {
+      // Not threads_.size(): workers may ask for this while the constructor
+      // is still starting the others.
+      return queues_.size();
+    }
+
+    void submit(task t);
+
+    // Block until every submitted task (including any tasks they submit)
+    // has finished. If a task threw, rethrow the first exception.
+    void wait();
+
+    // The index of the calling thread within this pool, or `no_worker` if
+    // it isn't one of our workers.
+    size_t current_worker() const;
+  private:
+    struct queue {
+      std::mutex lock;
+      std::deque<task> tasks;
+    };
+
+    void run(size_t index);
+    bool pop(size_t index, task &t);
+    void finish(std::exception_ptr error);
+
+    std::vector<std::unique_ptr<queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex lock_;
+    std::condition_variable work_available_, all_done_;
+    std::atomic<size_t> queued_;
+    size_t unfinished_ = 0;
+    size_t next_queue_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+  };
+
+  // Call `f(begin, end)` over [0, n) in blocks of `grain` elements, spread
+  // across `pool` if one is given. This waits on the pool, so it mustn't be
+  // called from one of the pool's own workers.
+  template<typename Function>
+  void for_each_block(thread_pool *pool, size_t n, size_t grain,
+                      Function &&f) {
+    if(!pool || pool->size() == 1 || n <= grain) {
+      f(size_t(0), n);
+      return;
+    }
+
+    for(size_t begin = 0; begin < n; begin += grain) {
+      size_t end = std::min(n, begin + grain);
+      pool->submit([&f, begin, end]() { f(begin, end); });
+    }
+    pool->wait();
+  }
+
+} // namespace parallel
+
+#endif
@@ -1,50 +1,308 @@
 #ifndef INC_MUSPELHEIM_VARIATIONS_HPP
 #define INC_MUSPELHEIM_VARIATIONS_HPP
 
+#include <cassert>
 #include <cmath>
+#include <functional>
+#include <type_traits>
 
+#include "fast_math.hpp"
 #include "vec2d.hpp"
 
 namespace math {
 
-  inline vec2d linear(const vec2d &p, const affine_transform &) {
-    return p;
+  // The built-in variations, generic over the scalar type. The variation
+  // class picks between these and the approximations in namespace fast
+  // when iterating; flames name them with the double versions further down.
+  namespace exact {
+
+    template<typename T>
+    inline basic_vec2d<T> linear(const basic_vec2d<T> &p,
+                                 const basic_affine_transform<T> &) {
+      return p;
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> sinusoidal(const basic_vec2d<T> &p,
+                                     const basic_affine_transform<T> &) {
+      return {std::sin(p.x), std::cos(p.y)};
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> spherical(const basic_vec2d<T> &p,
+                                    const basic_affine_transform<T> &) {
+      return p / (p.x*p.x + p.y*p.y);
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> swirl(const basic_vec2d<T> &p,
+                                const basic_affine_transform<T> &) {
+      T r2 = p.x*p.x + p.y*p.y;
+      T s = std::sin(r2), c = std::cos(r2);
+      return {p.x * s - p.y * c, p.x * s + p.y * c};
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> handkerchief(const basic_vec2d<T> &p,
+                                       const basic_affine_transform<T> &) {
+      T r = std::hypot(p.x, p.y);
+      T theta = std::atan(p.x / p.y);
+      return {
+        r * std::sin(theta + r),
+        r * std::cos(theta - r)
+      };
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> spiral(const basic_vec2d<T> &p,
+                                 const basic_affine_transform<T> &) {
+      T r = std::hypot(p.x, p.y);
+      T theta = std::atan(p.x / p.y);
+      return {
+        (std::cos(theta) + std::sin(r)) / r,
+        (std::sin(theta) - std::cos(r)) / r
+      };
+    }
+
+  } // namespace exact
+
+  namespace fast {
+
+    // The variations with transcendental functions, built on the
+    // approximations in fast_math.hpp. handkerchief and spiral avoid atan
+    // entirely: with theta = atan(x / y), r * sin(theta) = x * sgn(y) and
+    // r * cos(theta) = |y|.
+
+    template<typename T>
+    inline basic_vec2d<T> sinusoidal(const basic_vec2d<T> &p,
+                                     const basic_affine_transform<T> &) {
+      return {fast::sin(p.x), fast::cos(p.y)};
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> swirl(const basic_vec2d<T> &p,
+                                const basic_affine_transform<T> &) {
+      T r2 = p.x*p.x + p.y*p.y, s, c;
+      sincos(r2, s, c);
+      return {p.x * s - p.y * c, p.x * s + p.y * c};
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> handkerchief(const basic_vec2d<T> &p,
+                                       const basic_affine_transform<T> &) {
+      T r = std::sqrt(p.x*p.x + p.y*p.y), s, c;
+      sincos(r, s, c);
+      T rs = p.x * std::copysign(T(1), p.y), rc = std::fabs(p.y);
+      return {rs * c + rc * s, rc * c + rs * s};
+    }
+
+    template<typename T>
+    inline basic_vec2d<T> spiral(const basic_vec2d<T> &p,
+                                 const basic_affine_transform<T> &) {
+      T r = std::sqrt(p.x*p.x + p.y*p.y), s, c;
+      sincos(r, s, c);
+      T rs = p.x * std::copysign(T(1), p.y), rc = std::fabs(p.y);
+      return {(rc / r + s) / r, (rs / r - c) / r};
+    }
+
+  } // namespace fast
+
+  inline vec2d linear(const vec2d &p, const affine_transform &t) {
+    return exact::linear(p, t);
   }
 
-  inline vec2d sinusoidal(const vec2d &p, const affine_transform &) {
-    return {std::sin(p.x), std::cos(p.y)};
+  inline vec2d sinusoidal(const vec2d &p, const affine_transform &t) {
+    return exact::sinusoidal(p, t);
   }
 
-  inline vec2d spherical(const vec2d &p, const affine_transform &) {
-    return p / (p.x*p.x + p.y*p.y);
+  inline vec2d spherical(const vec2d &p, const affine_transform &t) {
+    return exact::spherical(p, t);
   }
 
-  inline vec2d swirl(const vec2d &p, const affine_transform &) {
-    auto r2 = p.x*p.x + p.y*p.y;
-    return {
-      p.x * std::sin(r2) - p.y * cos(r2),
-      p.x * std::sin(r2) + p.y * cos(r2)
-    };
+  inline vec2d swirl(const vec2d &p, const affine_transform &t) {
+    return exact::swirl(p, t);
   }
 
-  inline vec2d handkerchief(const vec2d &p, const affine_transform &) {
-    const auto &r = std::hypot(p.x, p.y);
-    const auto &theta = std::atan(p.x / p.y);
-    return {
-      r * std::sin(theta + r),
-      r * std::cos(theta - r)
-    };
+  inline vec2d handkerchief(const vec2d &p, const affine_transform &t) {
+    return exact::handkerchief(p, t);
   }
 
-  inline vec2d spiral(const vec2d &p, const affine_transform &) {
-    const auto &r = std::hypot(p.x, p.y);
-    const auto &theta = std::atan(p.x / p.y);
-    return {
-      (std::cos(theta) + std::sin(r)) / r,
-      (std::sin(theta) - std::cos(r)) / r
-    };
+  inline vec2d spiral(const vec2d &p, const affine_transform &t) {
+    return exact::spiral(p, t);
   }
 
+  // Whether the built-in variations call the standard library's
+  // transcendental functions or the approximations in namespace fast.
+  enum class precision {
+    exact,
+    fast
+  };
+
+  enum class variation_type {
+    linear,
+    sinusoidal,
+    spherical,
+    swirl,
+    handkerchief,
+    spiral,
+    custom
+  };
+
+  // A variation from the closed set above, evaluated with an inline switch.
+  // Anything else is stored in a std::function and called indirectly. The
+  // built-in variations are evaluated in the precision the caller asks for;
+  // custom ones are always called as they are.
+  class variation {
+  public:
+    using function_pointer = vec2d (*)(const vec2d &, const affine_transform &);
+    using custom_function = std::function<
+      vec2d(const vec2d &, const affine_transform &)
+    >;
+
+    variation(variation_type type) : type_(type) {
+      assert(type != variation_type::custom);
+    }
+
+    template<typename Function, typename = std::enable_if_t<
+      !std::is_same_v<std::decay_t<Function>, variation> &&
+      !std::is_convertible_v<Function, variation_type>
+    >>
+    variation(Function &&f) : type_(variation_type::custom) {
+      if constexpr(std::is_convertible_v<Function, function_pointer>) {
+        function_pointer fp = f;
+        type_ = lookup(fp);
+        if(type_ == variation_type::custom)
+          custom_ = fp;
+      } else {
+        custom_ = std::forward<Function>(f);
+      }
+    }
+
+    template<typename T>
+    inline basic_vec2d<T>
+    operator ()(const basic_vec2d<T> &p, const basic_affine_transform<T> &t,
+                precision prec = precision::exact) const {
+      const bool use_fast = prec == precision::fast;
+      switch(type_) {
+      case variation_type::linear:
+        return exact::linear(p, t);
+      case variation_type::sinusoidal:
+        return use_fast ? fast::sinusoidal(p, t) : exact::sinusoidal(p, t);
+      case variation_type::spherical:
+        return exact::spherical(p, t);
+      case variation_type::swirl:
+        return use_fast ? fast::swirl(p, t) : exact::swirl(p, t);
+      case variation_type::handkerchief:
+        return use_fast ? fast::handkerchief(p, t) : exact::handkerchief(p, t);
+      case variation_type::spiral:
+        return use_fast ? fast::spiral(p, t) : exact::spiral(p, t);
+      default:
+        if constexpr(std::is_same_v<T, double>) {
+          return custom_(p, t);
+        } else {
+          return basic_vec2d<T>(custom_(vec2d(p), affine_transform(t)));
+        }
+      }
+    }
+
+    // Accumulate `weight` times this variation into `n` lanes of (out_x,
+    // out_y), in precision `prec`. The switch happens once per call, so each
+    // case's loop is free of indirect calls (and, for the fast variations, of
+    // branches).
+    template<typename T>
+    inline void
+    accumulate(T weight, const basic_affine_transform<T> &t, const T *x,
+               const T *y, T *out_x, T *out_y, size_t n,
+               precision prec = precision::exact) const {
+      if(prec == precision::fast) {
+        switch(type_) {
+        case variation_type::sinusoidal:
+          return accumulate_with(fast::sinusoidal<T>, weight, t, x, y, out_x,
+                                 out_y, n);
+        case variation_type::swirl:
+          return accumulate_with(fast::swirl<T>, weight, t, x, y, out_x,
+                                 out_y, n);
+        case variation_type::handkerchief:
+          return accumulate_with(fast::handkerchief<T>, weight, t, x, y,
+                                 out_x, out_y, n);
+        case variation_type::spiral:
+          return accumulate_with(fast::spiral<T>, weight, t, x, y, out_x,
+                                 out_y, n);
+        default:
+          break;
+        }
+      }
+
+      switch(type_) {
+      case variation_type::linear:
+        return accumulate_with(exact::linear<T>, weight, t, x, y, out_x,
+                               out_y, n);
+      case variation_type::sinusoidal:
+        return accumulate_with(exact::sinusoidal<T>, weight, t, x, y, out_x,
+                               out_y, n);
+      case variation_type::spherical:
+        return accumulate_with(exact::spherical<T>, weight, t, x, y, out_x,
+                               out_y, n);
+      case variation_type::swirl:
+        return accumulate_with(exact::swirl<T>, weight, t, x, y, out_x,
+                               out_y, n);
+      case variation_type::handkerchief:
+        return accumulate_with(exact::handkerchief<T>, weight, t, x, y,
+                               out_x, out_y, n);
+      case variation_type::spiral:
+        return accumulate_with(exact::spiral<T>, weight, t, x, y, out_x,
+                               out_y, n);
+      default:
+        if constexpr(std::is_same_v<T, double>) {
+          return accumulate_with(custom_, weight, t, x, y, out_x, out_y, n);
+        } else {
+          // Custom variations only come in double, so widen around them.
+          const affine_transform wide(t);
+          return accumulate_with([&](
+            const basic_vec2d<T> &p, const basic_affine_transform<T> &
+          ) {
+            return basic_vec2d<T>(custom_(vec2d(p), wide));
+          }, weight, t, x, y, out_x, out_y, n);
+        }
+      }
+    }
+
+    inline variation_type type() const {
+      return type_;
+    }
+  private:
+    static variation_type lookup(function_pointer f) {
+      if(f == linear)
+        return variation_type::linear;
+      if(f == sinusoidal)
+        return variation_type::sinusoidal;
+      if(f == spherical)
+        return variation_type::spherical;
+      if(f == swirl)
+        return variation_type::swirl;
+      if(f == handkerchief)
+        return variation_type::handkerchief;
+      if(f == spiral)
+        return variation_type::spiral;
+      return variation_type::custom;
+    }
+
+    template<typename Function, typename T>
+    static inline void
+    accumulate_with(const Function &f, T weight,
+                    const basic_affine_transform<T> &t, const T *x,
+                    const T *y, T *out_x, T *out_y, size_t n) {
+      for(size_t i = 0; i != n; i++) {
+        auto value = f(basic_vec2d<T>(x[i], y[i]), t);
+        out_x[i] += weight * value.x;
+        out_y[i] += weight * value.y;
+      }
+    }
+
+    variation_type type_;
+    custom_function custom_;
+  };
+
 } // namespace math
 
 #endif
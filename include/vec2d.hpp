@@ -5,133 +5,157 @@
 
 namespace math {
 
-  struct vec2d {
-    vec2d() = default;
-    vec2d(double x, double y) : x(x), y(y) {}
+  // A 2D vector with components of type `T`. Flames are defined with
+  // doubles (vec2d); float is enough to iterate at screen or print scale.
+  template<typename T>
+  struct basic_vec2d {
+    using value_type = T;
 
-    vec2d & operator +=(const vec2d &rhs) {
+    basic_vec2d() = default;
+    basic_vec2d(T x, T y) : x(x), y(y) {}
+
+    template<typename U>
+    explicit basic_vec2d(const basic_vec2d<U> &p)
+      : x(static_cast<T>(p.x)), y(static_cast<T>(p.y)) {}
+
+    basic_vec2d & operator +=(const basic_vec2d &rhs) {
       x += rhs.x;
       y += rhs.y;
       return *this;
     }
 
-    vec2d & operator -=(const vec2d &rhs) {
+    basic_vec2d & operator -=(const basic_vec2d &rhs) {
       x -= rhs.x;
       y -= rhs.y;
       return *this;
     }
 
-    vec2d & operator *=(double rhs) {
+    basic_vec2d & operator *=(T rhs) {
       x *= rhs;
       y *= rhs;
       return *this;
     }
 
-    vec2d & operator /=(double rhs) {
+    basic_vec2d & operator /=(T rhs) {
       x /= rhs;
       y /= rhs;
       return *this;
     }
 
-    friend vec2d operator +(const vec2d &x, const vec2d &y) {
-      return vec2d(x) += y;
+    friend basic_vec2d operator +(const basic_vec2d &x, const basic_vec2d &y) {
+      return basic_vec2d(x) += y;
     }
 
-    friend vec2d operator -(const vec2d &x, const vec2d &y) {
-      return vec2d(x) -= y;
+    friend basic_vec2d operator -(const basic_vec2d &x, const basic_vec2d &y) {
+      return basic_vec2d(x) -= y;
     }
 
-    friend vec2d operator *(const vec2d &x, double &y) {
-      return vec2d(x) *= y;
+    friend basic_vec2d operator *(const basic_vec2d &x, T y) {
+      return basic_vec2d(x) *= y;
     }
 
-    friend vec2d operator *(double x, const vec2d &y) {
-      return vec2d(y) *= x;
+    friend basic_vec2d operator *(T x, const basic_vec2d &y) {
+      return basic_vec2d(y) *= x;
     }
 
-    friend vec2d operator /(const vec2d &x, double y) {
-      return vec2d(x) /= y;
+    friend basic_vec2d operator /(const basic_vec2d &x, T y) {
+      return basic_vec2d(x) /= y;
     }
 
-    double x, y;
+    T x, y;
   };
 
-  struct affine_transform {
-    affine_transform() = default;
-    affine_transform(double a, double b, double c,
-                     double d, double e, double f) :
+  using vec2d = basic_vec2d<double>;
+
+  template<typename T>
+  struct basic_affine_transform {
+    using value_type = T;
+
+    basic_affine_transform() = default;
+    basic_affine_transform(T a, T b, T c, T d, T e, T f) :
       a(a), b(b), c(c), d(d), e(e), f(f) {}
 
-    vec2d operator ()(const vec2d &p) const {
+    template<typename U>
+    explicit basic_affine_transform(const basic_affine_transform<U> &t) :
+      a(static_cast<T>(t.a)), b(static_cast<T>(t.b)), c(static_cast<T>(t.c)),
+      d(static_cast<T>(t.d)), e(static_cast<T>(t.e)), f(static_cast<T>(t.f))
+    {}
+
+    basic_vec2d<T> operator ()(const basic_vec2d<T> &p) const {
       return { a*p.x + b*p.y + c,
                d*p.x + e*p.y + f };
     }
 
-    affine_transform & operator +=(const affine_transform &rhs) {
+    basic_affine_transform & operator +=(const basic_affine_transform &rhs) {
       a += rhs.a; b += rhs.b; c += rhs.c;
       d += rhs.d; e += rhs.e; f += rhs.f;
       return *this;
     }
 
-    affine_transform & operator -=(const affine_transform &rhs) {
+    basic_affine_transform & operator -=(const basic_affine_transform &rhs) {
       a -= rhs.a; b -= rhs.b; c -= rhs.c;
       d -= rhs.d; e -= rhs.e; f -= rhs.f;
       return *this;
     }
 
-    affine_transform & operator *=(double rhs) {
+    basic_affine_transform & operator *=(T rhs) {
       a *= rhs; b *= rhs; c *= rhs;
       d *= rhs; e *= rhs; f *= rhs;
       return *this;
     }
 
-    affine_transform & operator /=(double rhs) {
+    basic_affine_transform & operator /=(T rhs) {
       a /= rhs; b /= rhs; c /= rhs;
       d /= rhs; e /= rhs; f /= rhs;
       return *this;
     }
 
-    friend affine_transform
-    operator +(const affine_transform &x, const affine_transform &y) {
-      return affine_transform(x) += y;
+    friend basic_affine_transform
+    operator +(const basic_affine_transform &x,
+               const basic_affine_transform &y) {
+      return basic_affine_transform(x) += y;
     }
 
-    friend affine_transform
-    operator -(const affine_transform &x, const affine_transform &y) {
-      return affine_transform(x) -= y;
+    friend basic_affine_transform
+    operator -(const basic_affine_transform &x,
+               const basic_affine_transform &y) {
+      return basic_affine_transform(x) -= y;
     }
 
-    friend affine_transform
-    operator *(const affine_transform &x, double &y) {
-      return affine_transform(x) *= y;
+    friend basic_affine_transform
+    operator *(const basic_affine_transform &x, T y) {
+      return basic_affine_transform(x) *= y;
     }
 
-    friend affine_transform
-    operator *(double x, const affine_transform &y) {
-      return affine_transform(y) *= x;
+    friend basic_affine_transform
+    operator *(T x, const basic_affine_transform &y) {
+      return basic_affine_transform(y) *= x;
     }
 
-    friend affine_transform
-    operator /(const affine_transform &x, double &y) {
-      return affine_transform(x) /= y;
+    friend basic_affine_transform
+    operator /(const basic_affine_transform &x, T y) {
+      return basic_affine_transform(x) /= y;
     }
 
-    friend affine_transform
-    operator *(const affine_transform &x, const affine_transform &y) {
+    friend basic_affine_transform
+    operator *(const basic_affine_transform &x,
+               const basic_affine_transform &y) {
       return {
         x.a*y.a + x.b*y.d, x.a*y.b + x.b*y.e, x.a*y.c + x.b*y.f + x.c,
         x.d*y.a + x.e*y.d, x.d*y.b + x.e*y.e, x.d*y.c + x.e*y.f + x.f
       };
     }
 
-    affine_transform & operator *=(const affine_transform &rhs) {
+    basic_affine_transform & operator *=(const basic_affine_transform &rhs) {
       *this = *this * rhs;
       return *this;
     }
 
-    double a, b, c, d, e, f;
+    T a, b, c, d, e, f;
   };
 
+  using affine_transform = basic_affine_transform<double>;
+
   inline affine_transform identity() {
     return { 1, 0, 0,
              0, 1, 0 };
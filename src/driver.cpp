@@ -1,39 +1,281 @@
+#include "animation.hpp"
+#include "auto_frame.hpp"
 #include "colors.hpp"
+#include "density_filter.hpp"
+#include "flame_file.hpp"
+#include "histogram_file.hpp"
 #include "ifs.hpp"
+#include "image_writer.hpp"
 #include "muspelheim.hpp"
+#include "program_options.hpp"
+#include "random.hpp"
+#include "render.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
 
+#include <chrono>
+#include <fstream>
 #include <future>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
 
-#define png_infopp_NULL (png_infopp)NULL
-#define int_p_NULL (int*)NULL
-
-#include <boost/gil/extension/io/png_dynamic_io.hpp>
 #include <boost/gil/typedefs.hpp>
-#include <boost/program_options.hpp>
 
-// Put this in the boost namespace so that ADL picks them up (via the
-// boost::any parameter).
-namespace boost {
+static ifs::render_budget::clock::duration seconds(double value) {
+  return std::chrono::duration_cast<ifs::render_budget::clock::duration>(
+    std::chrono::duration<double>(value)
+  );
+}
+
+// Parse "W" (for a square) or "WxH".
+static std::optional<boost::gil::point2<ptrdiff_t>>
+parse_size(const std::string &s) {
+  auto x = s.find('x');
+  std::string w = s.substr(0, x);
+  std::string h = x == std::string::npos ? w : s.substr(x + 1);
+  for(const auto &digits : {w, h}) {
+    if(digits.empty() || digits.size() > 9 ||
+       digits.find_first_not_of("0123456789") != std::string::npos)
+      return std::nullopt;
+  }
+  boost::gil::point2<ptrdiff_t> size(std::stol(w), std::stol(h));
+  if(size.x == 0 || size.y == 0)
+    return std::nullopt;
+  return size;
+}
+
+// Parse "X,Y".
+static std::optional<math::vec2d> parse_point(const std::string &s) {
+  auto comma = s.find(',');
+  if(comma == std::string::npos)
+    return std::nullopt;
+  try {
+    size_t end_x, end_y;
+    double x = std::stod(s.substr(0, comma), &end_x);
+    double y = std::stod(s.substr(comma + 1), &end_y);
+    if(end_x != comma || end_y != s.size() - comma - 1)
+      return std::nullopt;
+    return math::vec2d{x, y};
+  } catch(const std::exception &) {
+    return std::nullopt;
+  }
+}
+
+// The file name for `frame`: the first run of '#'s in `pattern` is replaced
+// with the frame number, zero-padded to as many digits; without one,
+// "-NNNN" goes before the extension.
+static std::string frame_filename(std::string pattern, size_t frame) {
+  auto begin = pattern.find('#');
+  if(begin == std::string::npos) {
+    auto dot = pattern.rfind('.');
+    auto slash = pattern.rfind('/');
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+      dot = pattern.size();
+    pattern.insert(dot, "-####");
+    begin = dot + 1;
+  }
+  auto end = pattern.find_first_not_of('#', begin);
+  size_t width = (end == std::string::npos ? pattern.size() : end) - begin;
+
+  std::string number = std::to_string(frame);
+  if(number.size() < width)
+    number.insert(0, width - number.size(), '0');
+  return pattern.replace(begin, width, number);
+}
+
+// Add `stats` into `total`, stream by stream.
+static void add_thread_stats(std::vector<stats::counters> &total,
+                             std::vector<stats::counters> &&stats) {
+  if(total.empty()) {
+    total = std::move(stats);
+  } else {
+    for(size_t i = 0; i != total.size(); i++)
+      total[i] += stats[i];
+  }
+}
+
+// Render `frames` frames of an animation through `keys`, each with
+// `budget`. Rather than allocating a histogram per frame, two are allocated
+// up front and alternated: while frame k + 1 iterates into one on `pool`,
+// frame k is filtered, tone mapped and written from the other on a
+// separate thread.
+template<typename Counter>
+static void render_sequence(
+  const std::vector<muspelheim::flame_function_system> &keys, size_t frames,
+  const boost::gil::point2<ptrdiff_t> &dims, bool single,
+  math::precision precision, const ifs::render_budget &budget,
+  const images::filter_options &filter, const images::tone_map_options &tone,
+  images::image_format format, const std::string &pattern,
+  parallel::thread_pool &pool, stats::timings &timings,
+  std::vector<stats::counters> *thread_stats
+) {
+  std::unique_ptr<images::shared_image_data<Counter>> histograms[2];
+  for(size_t i = 0; i != std::min<size_t>(frames, 2); i++) {
+    histograms[i] = std::make_unique<images::shared_image_data<Counter>>(
+      dims
+    );
+  }
+
+  stats::timings write_timings;
+  std::future<void> pending;
+  for(size_t frame = 0; frame != frames; frame++) {
+    auto &histogram = *histograms[frame % 2];
+    auto funcs = ifs::keyframe_at(keys, frame, frames);
+
+    auto start = stats::clock::now();
+    histogram.clear(&pool);
+    std::vector<stats::counters> frame_stats;
+    auto *counters = thread_stats ? &frame_stats : nullptr;
+    if(single) {
+      ifs::render<float>(funcs, histogram, pool, budget, nullptr, counters,
+                         precision);
+    } else {
+      ifs::render(funcs, histogram, pool, budget, nullptr, counters,
+                  precision);
+    }
+    timings.add("iterate", stats::clock::now() - start);
+
+    if(thread_stats)
+      add_thread_stats(*thread_stats, std::move(frame_stats));
+
+    // The writer has its own timings, since it runs alongside this thread.
+    if(pending.valid())
+      pending.get();
+    pending = std::async(std::launch::async, [
+      &, frame, palette = funcs.palette()
+    ]() {
+      auto filename = frame_filename(pattern, frame);
+      if(filter.trivial()) {
+        images::write_image(filename, histogram.view(), palette, tone, format,
+                            nullptr, &write_timings);
+      } else {
+        auto start = stats::clock::now();
+        auto filtered = images::filter_histogram(histogram.view(), filter);
+        write_timings.add("filter", stats::clock::now() - start);
+        images::write_image(filename, filtered.view(), palette, tone, format,
+                            nullptr, &write_timings);
+      }
+    });
+  }
+
+  if(pending.valid())
+    pending.get();
+  for(const auto &[name, time] : write_timings.stages())
+    timings.add(name, time);
+}
+
+// Render `budget` into `dst` as `tiles` strips of rows, one after another.
+// Each strip gets a histogram of its own over its rows of `dst` and
+// replays the same random streams, keeping only the hits that land on it,
+// so the result is the same as rendering all of `dst` at once, but only
+// one strip is written to at a time. That keeps the working set to one
+// strip even if `dst` is a memory-mapped file far larger than RAM. The
+// price is that every strip iterates the whole budget, so the render costs
+// `tiles` times the CPU time of an untiled one.
+static void render_tiles(
+  const muspelheim::flame_function_system &funcs,
+  const images::raw_image_view<> &dst, size_t tiles, bool single,
+  math::precision precision,
+  const ifs::render_budget &budget, parallel::thread_pool &pool,
+  std::vector<stats::counters> *thread_stats
+) {
+  const auto dims = dst.dimensions();
+  const ptrdiff_t n = std::min<ptrdiff_t>(tiles, dims.y);
+  for(ptrdiff_t t = 0; t != n; t++) {
+    const ptrdiff_t y0 = dims.y * t / n, y1 = dims.y * (t + 1) / n;
+    images::raw_image_view<> strip = {
+      boost::gil::subimage_view(dst.color, 0, y0, dims.x, y1 - y0),
+      boost::gil::subimage_view(dst.alpha, 0, y0, dims.x, y1 - y0)
+    };
+    images::shared_image_data<> histogram(strip);
+    histogram.set_canvas(dims, {0, y0});
 
-  template<typename T>
-  void validate(boost::any &v, const std::vector<std::string> &values,
-                std::optional<T>*, int) {
-    using namespace boost::program_options;
-    using optional_t = std::optional<T>;
+    std::vector<stats::counters> tile_stats;
+    auto *counters = thread_stats ? &tile_stats : nullptr;
+    if(single) {
+      ifs::render<float>(funcs, histogram, pool, budget, nullptr, counters,
+                         precision);
+    } else {
+      ifs::render(funcs, histogram, pool, budget, nullptr, counters,
+                  precision);
+    }
+    if(thread_stats)
+      add_thread_stats(*thread_stats, std::move(tile_stats));
+  }
+}
 
-    if(v.empty())
-      v = optional_t();
-    auto *val = boost::any_cast<optional_t>(&v);
-    assert(val);
+// Render `budget` into `histogram`, in `tiles` strips if more than one,
+// then filter, tone map and write it to `filename`. If the histogram lives
+// in `file`, already holding `steps_done` iterations, the file is
+// checkpointed along the way.
+template<typename Counter>
+static void render_image(
+  const muspelheim::flame_function_system &funcs,
+  images::shared_image_data<Counter> &histogram, images::histogram_file *file,
+  size_t steps_done, size_t tiles, bool single, math::precision precision,
+  const ifs::render_budget &budget, const images::filter_options &filter,
+  const images::tone_map_options &tone, images::image_format format,
+  const std::string &filename, parallel::thread_pool &pool,
+  stats::timings &timings, std::vector<stats::counters> *thread_stats
+) {
+  auto start = stats::clock::now();
+  stats::clock::duration checkpoint_time{};
+  auto on_checkpoint = [&](size_t done) {
+    auto start = stats::clock::now();
+    if(file)
+      file->checkpoint(steps_done + done);
+    checkpoint_time += stats::clock::now() - start;
+  };
+  if(tiles > 1) {
+    // Compact planes can't be viewed a strip at a time.
+    if constexpr(std::is_same_v<Counter, uint32_t>) {
+      render_tiles(funcs, histogram.view(), tiles, single, precision, budget,
+                   pool, thread_stats);
+      if(file)
+        file->checkpoint(budget.steps);
+    } else {
+      throw std::invalid_argument("only uint32 counts can be rendered in "
+                                  "tiles");
+    }
+  } else if(single) {
+    ifs::render<float>(funcs, histogram, pool, budget, on_checkpoint,
+                       thread_stats, precision);
+  } else {
+    ifs::render(funcs, histogram, pool, budget, on_checkpoint, thread_stats,
+                precision);
+  }
+  timings.add("iterate", stats::clock::now() - start - checkpoint_time);
+  if(file)
+    timings.add("checkpoint", checkpoint_time);
 
-    boost::any a;
-    validate(a, values, static_cast<T*>(nullptr), 0);
-    *val = boost::any_cast<T>(a);
+  if(filter.trivial()) {
+    images::write_image(filename, histogram.view(), funcs.palette(), tone,
+                        format, &pool, &timings);
+  } else {
+    auto start = stats::clock::now();
+    auto filtered = images::filter_histogram(histogram.view(), filter,
+                                             &pool);
+    timings.add("filter", stats::clock::now() - start);
+    images::write_image(filename, filtered.view(), funcs.palette(), tone,
+                        format, &pool, &timings);
   }
+}
 
-} // namespace boost
+// Call `f` with a value of the hit counter type called `name` (see
+// counters.hpp), which must be "uint32", "checked" or "compact".
+template<typename Function>
+static void with_counter(const std::string &name, Function &&f) {
+  if(name == "checked")
+    f(images::checked_count());
+  else if(name == "compact")
+    f(images::compact_count());
+  else
+    f(uint32_t());
+}
 
 int main(int argc, const char *argv[]) {
   using namespace math;
@@ -42,24 +284,102 @@ int main(int argc, const char *argv[]) {
   namespace opts = boost::program_options;
 
   bool show_help = false;
-  size_t steps = 1000000;
-  ptrdiff_t size = 666;
+  std::optional<std::string> flame_file;
+  std::optional<std::string> write_flame;
+  std::vector<std::string> keyframe_files;
+  std::optional<size_t> frames;
+  std::optional<size_t> steps;
+  std::optional<double> time_budget;
+  std::optional<double> tolerance;
+  std::optional<uint64_t> seed;
+  std::optional<std::string> size_name;
+  std::optional<std::string> center_name;
+  std::optional<double> zoom;
+  std::optional<double> rotation;
+  bool auto_frame = false;
+  ifs::frame_options framing;
+  size_t tiles = 1;
+  images::filter_options filter;
   size_t num_jobs = 1;
+  std::string precision_name = "exact";
+  std::string counter_name = "uint32";
+  bool single = false;
+  std::optional<std::string> symmetry_name;
   double gamma = 1.0;
   std::optional<double> hdr;
+  int depth = 8;
+  std::optional<std::string> histogram_file;
+  bool resume = false;
+  std::optional<double> checkpoint;
+  bool show_stats = false;
   std::string output_file = std::string(argv[0]) + ".png";
 
   opts::options_description generic_opts("Generic options");
   generic_opts.add_options()
     ("help,h", opts::value(&show_help)->zero_tokens(), "show help")
+    ("stats", opts::value(&show_stats)->zero_tokens(),
+     "print render statistics as JSON")
+    ("flame", opts::value(&flame_file)->value_name("FILE"),
+     "render the flame described in FILE instead of the built-in one")
+    ("write-flame", opts::value(&write_flame)->value_name("FILE"),
+     "write the flame to FILE as a flame file and exit")
   ;
 
   opts::options_description compute_opts("Compute options");
   compute_opts.add_options()
-    ("steps,n", opts::value(&steps)->value_name("N"), "number of iterations")
-    ("size,s", opts::value(&size)->value_name("SIZE"), "image size")
+    ("steps,n", opts::value(&steps)->value_name("N"),
+     "total number of iterations (default: 1000000, or unlimited with "
+     "--time-budget or --converge)")
+    ("time-budget,t", opts::value(&time_budget)->value_name("SECONDS"),
+     "stop iterating after SECONDS")
+    ("converge", opts::value(&tolerance)->value_name("TOL"),
+     "stop iterating once the estimated error of the density falls below "
+     "TOL (e.g. 0.02)")
+    ("size,s", opts::value(&size_name)->value_name("SIZE"),
+     "image size: W for a square, or WxH (default: 666)")
+    ("center", opts::value(&center_name)->value_name("X,Y"),
+     "center the image on (X, Y) (default: the flame's own, or 0,0)")
+    ("zoom", opts::value(&zoom)->value_name("ZOOM"),
+     "magnification; at 1, [-1, 1] fits the image's shorter side "
+     "(default: the flame's own, or 1)")
+    ("rotate", opts::value(&rotation)->value_name("RADIANS"),
+     "turn the view by RADIANS, turning the flame the other way (default: "
+     "the flame's own, or 0)")
+    ("auto-frame", opts::value(&auto_frame)->zero_tokens(),
+     "before rendering, run a short pre-pass to find where the flame's "
+     "points land, and center and zoom on that")
+    ("frame-quantile", opts::value(&framing.quantile)->value_name("Q"),
+     "with --auto-frame, frame the box between the Q and 1 - Q quantiles "
+     "of the points in each direction (default: 0.005)")
+    ("tiles", opts::value(&tiles)->value_name("N"),
+     "render the histogram in N strips, one after another, each replaying "
+     "the same random streams and keeping only its own hits; with "
+     "--histogram, only one strip needs to be in memory at a time, but "
+     "every strip runs all --steps iterations, so this takes N times the "
+     "CPU time (default: 1)")
+    ("oversample", opts::value(&filter.oversample)->value_name("N"),
+     "render the histogram at N times the image size in each dimension and "
+     "filter it down (default: 1)")
     ("jobs,j", opts::value(&num_jobs)->value_name("JOBS"),
-     "number of parallel jobs")
+     "number of worker threads")
+    ("seed", opts::value(&seed)->value_name("SEED"),
+     "random seed; the same seed and number of jobs give the same image "
+     "(default: random)")
+    ("precision", opts::value(&precision_name)->value_name("PRECISION"),
+     "variation math: exact, or fast to use polynomial approximations of "
+     "sin and cos (default: exact)")
+    ("float", opts::value(&single)->zero_tokens(),
+     "iterate in single precision; faster, and precise enough unless "
+     "zoomed far in")
+    ("counter", opts::value(&counter_name)->value_name("COUNTER"),
+     "hit counts: uint32, which stop at 2^32 - 1; checked, 64 bits that "
+     "fail the render rather than stop; or compact, 16 bits per pixel plus "
+     "32 more only where needed, for less memory (default: uint32)")
+    ("symmetry", opts::value(&symmetry_name)->value_name("SYM"),
+     "plot every point with its images under a symmetry: none, auto (detect "
+     "it), N (N-fold rotation) or dN (N-fold rotation and reflection); the "
+     "same density takes 1/N (or 1/2N) of the iterations (default: the "
+     "flame's own)")
   ;
 
   opts::options_description image_opts("Image options");
@@ -67,6 +387,39 @@ int main(int argc, const char *argv[]) {
     ("gamma,g", opts::value(&gamma)->value_name("GAMMA"), "gamma adjustment")
     ("hdr,H", opts::value(&hdr)->implicit_value(1.0, "1.0")->value_name("HDR"),
      "enable HDR")
+    ("de", opts::value(&filter.de_max_radius)->value_name("RADIUS"),
+     "blur sparse pixels by density estimation, up to RADIUS pixels for a "
+     "single hit (e.g. 9; default: off)")
+    ("de-min", opts::value(&filter.de_min_radius)->value_name("RADIUS"),
+     "smallest density estimation radius (default: 0)")
+    ("de-curve", opts::value(&filter.de_curve)->value_name("CURVE"),
+     "how fast the density estimation radius shrinks with the hit count "
+     "(default: 0.4)")
+    ("depth,d", opts::value(&depth)->value_name("BITS"),
+     "bits per channel for PNG output: 8 or 16 (default: 8); output files "
+     "ending in .pfm are written as 32-bit float PFM instead, tone mapped "
+     "just like a PNG (--gamma and --hdr included) but not quantized")
+  ;
+
+  opts::options_description animation_opts("Animation options");
+  animation_opts.add_options()
+    ("keyframe", opts::value(&keyframe_files)->value_name("FILE"),
+     "render an animation through each flame file given, in order; "
+     "consecutive keyframes must have the same functions and variations")
+    ("frames", opts::value(&frames)->value_name("N"),
+     "number of frames to render, with --steps, --time-budget or "
+     "--converge applying to each; the output file name's first run of "
+     "'#'s is replaced with the frame number (default: one per keyframe)")
+  ;
+
+  opts::options_description histogram_opts("Histogram options");
+  histogram_opts.add_options()
+    ("histogram", opts::value(&histogram_file)->value_name("FILE"),
+     "accumulate into a memory-mapped histogram file")
+    ("resume", opts::value(&resume)->zero_tokens(),
+     "continue the render saved in the histogram file")
+    ("checkpoint", opts::value(&checkpoint)->value_name("SECONDS"),
+     "save the histogram file every SECONDS")
   ;
 
   opts::options_description hidden_opts("Hidden options");
@@ -79,7 +432,7 @@ int main(int argc, const char *argv[]) {
   try {
     opts::options_description all_opts;
     all_opts.add(generic_opts).add(compute_opts).add(image_opts)
-      .add(hidden_opts);
+      .add(animation_opts).add(histogram_opts).add(hidden_opts);
     auto parsed = opts::command_line_parser(argc, argv)
       .options(all_opts).positional(pos).run();
 
@@ -93,35 +446,282 @@ int main(int argc, const char *argv[]) {
 
   if(show_help) {
     opts::options_description displayed;
-    displayed.add(generic_opts).add(compute_opts).add(image_opts);
+    displayed.add(generic_opts).add(compute_opts).add(image_opts)
+      .add(animation_opts).add(histogram_opts);
     std::cout << displayed << std::endl;
     return 0;
   }
 
-  std::vector< std::future<images::raw_image_data<rgb8>> > jobs;
-  for(size_t i = 0; i < num_jobs; i++) {
-    jobs.push_back(std::async(
-      std::launch::async, ifs::chaos_game<rgb8>,
-      muspelheim::function_system, point2<ptrdiff_t>{size, size}, steps
-    ));
+  if(depth != 8 && depth != 16) {
+    std::cerr << "--depth must be 8 or 16" << std::endl;
+    return 2;
   }
-  std::vector<images::raw_image_data<rgb8>> data;
-  for(auto &job : jobs)
-    data.push_back(job.get());
-  auto combined = images::combine(data);
 
-  rgb8_image_t image(size, size, rgb8(0), 0);
-  images::render(view(image), images::log_alpha(combined), gamma);
+  if(filter.oversample == 0) {
+    std::cerr << "--oversample must be positive" << std::endl;
+    return 2;
+  }
 
-  if(hdr) {
-    rgb8_image_t gray(size, size, rgb8(0), 0);
-    images::render_monochrome(
-      view(gray), images::linear_alpha(combined), rgb8(255, 255, 255), *hdr
-    );
-    images::lighten(view(image), const_view(gray));
+  if(!keyframe_files.empty() && (flame_file || write_flame ||
+                                  histogram_file)) {
+    std::cerr << "--keyframe can't be used with --flame, --write-flame or "
+              << "--histogram" << std::endl;
+    return 2;
+  }
+  if(frames && (keyframe_files.empty() || *frames == 0)) {
+    std::cerr << "--frames must be positive and requires --keyframe"
+              << std::endl;
+    return 2;
+  }
+
+  std::optional<point2<ptrdiff_t>> size;
+  if(size_name) {
+    size = parse_size(*size_name);
+    if(!size) {
+      std::cerr << "invalid size " << *size_name << std::endl;
+      return 2;
+    }
+  }
+
+  std::optional<math::vec2d> center;
+  if(center_name) {
+    center = parse_point(*center_name);
+    if(!center) {
+      std::cerr << "invalid center " << *center_name << std::endl;
+      return 2;
+    }
+  }
+  if(tolerance && !(*tolerance > 0)) {
+    std::cerr << "--converge must be positive" << std::endl;
+    return 2;
+  }
+  if(zoom && !(*zoom > 0)) {
+    std::cerr << "--zoom must be positive" << std::endl;
+    return 2;
+  }
+  if(auto_frame && (center || zoom)) {
+    std::cerr << "--auto-frame can't be used with --center or --zoom"
+              << std::endl;
+    return 2;
+  }
+  if(!(framing.quantile >= 0 && framing.quantile < 0.5)) {
+    std::cerr << "--frame-quantile must be in [0, 0.5)" << std::endl;
+    return 2;
+  }
+
+  // Every strip has to replay exactly the same iterations.
+  if(tiles == 0) {
+    std::cerr << "--tiles must be positive" << std::endl;
+    return 2;
+  }
+  if(tiles > 1 && (time_budget || tolerance || resume || checkpoint ||
+                   !keyframe_files.empty() || !filter.trivial())) {
+    std::cerr << "--tiles can't be used with --time-budget, --converge, "
+              << "--resume, --checkpoint, --keyframe, --oversample or --de"
+              << std::endl;
+    return 2;
+  }
+
+  if((resume || checkpoint) && !histogram_file) {
+    std::cerr << "--resume and --checkpoint require --histogram" << std::endl;
+    return 2;
+  }
+
+  if(counter_name != "uint32" && counter_name != "checked" &&
+     counter_name != "compact") {
+    std::cerr << "unknown counter " << counter_name << std::endl;
+    return 2;
+  }
+  // Histogram files hold 32-bit counts, and compact planes can't be split
+  // into strips.
+  if(counter_name != "uint32" && (histogram_file || tiles > 1)) {
+    std::cerr << "--counter " << counter_name << " can't be used with "
+              << "--histogram or --tiles" << std::endl;
+    return 2;
+  }
+
+  math::precision precision;
+  if(precision_name == "exact") {
+    precision = math::precision::exact;
+  } else if(precision_name == "fast") {
+    precision = math::precision::fast;
+  } else {
+    std::cerr << "unknown precision " << precision_name << std::endl;
+    return 2;
+  }
+
+  // Every flame to render: the keyframes, or else the one flame.
+  std::vector<muspelheim::flame_function_system> keys;
+  try {
+    for(const auto &name : keyframe_files)
+      keys.push_back(ifs::load_flame<rgb8>(name));
+    if(flame_file)
+      keys.push_back(ifs::load_flame<rgb8>(*flame_file));
+  } catch(const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if(keys.empty()) {
+    if(muspelheim::function_system.empty()) {
+      std::cerr << "no built-in flame; pass --flame" << std::endl;
+      return 2;
+    }
+    keys.push_back(muspelheim::function_system);
+  }
+
+  if(symmetry_name) {
+    auto sym = ifs::parse_symmetry(*symmetry_name);
+    if(!sym && *symmetry_name != "auto") {
+      std::cerr << "unknown symmetry " << *symmetry_name << std::endl;
+      return 2;
+    }
+    for(auto &key : keys)
+      key.set_symmetry(sym ? *sym : ifs::detect_symmetry(key));
+  }
+
+  for(auto &key : keys) {
+    auto cam = key.camera();
+    if(center)
+      cam.center = *center;
+    if(zoom)
+      cam.zoom = *zoom;
+    if(rotation)
+      cam.rotation = *rotation;
+    key.set_camera(cam);
+  }
+
+  // The histogram is oversampled; the image is its size divided back down.
+  const ptrdiff_t oversample = filter.oversample;
+  const auto dims = size.value_or(point2<ptrdiff_t>{666, 666}) * oversample;
+
+  stats::timings timings;
+
+  // The pre-pass has its own fixed seed, so the framing (and with it the
+  // flame's hash) doesn't change from one render to the next.
+  if(auto_frame) {
+    auto start = stats::clock::now();
+    for(auto &key : keys)
+      key.set_camera(ifs::auto_frame(key, dims, framing));
+    timings.add("frame", stats::clock::now() - start);
+  }
+
+  for(size_t i = 1; i < keys.size(); i++) {
+    try {
+      ifs::interpolate(keys[i - 1], keys[i], 0);
+    } catch(const std::exception &e) {
+      std::cerr << keyframe_files[i - 1] << " and " << keyframe_files[i]
+                << ": " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  auto &funcs = keys.front();
+
+  if(write_flame) {
+    try {
+      std::ofstream out(*write_flame);
+      if(!out)
+        throw std::runtime_error("unable to open " + *write_flame);
+      ifs::write_flame(out, funcs);
+    } catch(const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  std::optional<images::histogram_file> file;
+  size_t steps_done = 0;
+
+  try {
+    if(histogram_file) {
+      if(resume) {
+        file.emplace(*histogram_file);
+        if(file->header().flame_hash != ifs::hash(funcs))
+          throw std::runtime_error(*histogram_file + " is for another flame");
+        auto file_dims = file->dimensions();
+        if(size && file_dims != dims)
+          throw std::runtime_error(*histogram_file + " has another size");
+        if(file_dims.x % oversample || file_dims.y % oversample)
+          throw std::runtime_error(*histogram_file + " has another "
+                                   "oversampling factor");
+        steps_done = file->header().steps;
+      } else {
+        file = images::create_histogram_file(
+          *histogram_file, dims, funcs.palette(), ifs::hash(funcs)
+        );
+      }
+    }
+  } catch(const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  // --steps is the total for the render, including any resumed progress.
+  ifs::render_budget budget;
+  if(steps)
+    budget.steps = *steps - std::min(*steps, steps_done);
+  else if(!time_budget && !tolerance)
+    budget.steps = 1000000 - std::min<size_t>(1000000, steps_done);
+  if(time_budget)
+    budget.time = seconds(*time_budget);
+  budget.tolerance = tolerance;
+  if(checkpoint)
+    budget.checkpoint_interval = seconds(*checkpoint);
+
+  // Continue from a different point in the random streams when resuming so
+  // that we don't just repeat the iterations we already have.
+  if(!seed)
+    seed = (uint64_t(std::random_device{}()) << 32) | std::random_device{}();
+  budget.seed = steps_done ? rng::mix(*seed ^ rng::mix(steps_done)) : *seed;
+
+  parallel::thread_pool pool(num_jobs);
+  std::vector<stats::counters> thread_stats;
+  auto *counters = show_stats ? &thread_stats : nullptr;
+  if(!keyframe_files.empty()) {
+    try {
+      with_counter(counter_name, [&](auto count) {
+        render_sequence<decltype(count)>(
+          keys, frames.value_or(keys.size()), dims, single, precision,
+          budget, filter, {gamma, hdr},
+          images::image_format_for(output_file, depth), output_file, pool,
+          timings, counters
+        );
+      });
+    } catch(const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+
+    if(show_stats)
+      stats::write_json(std::cout, *seed, timings, thread_stats);
+    return 0;
+  }
+
+  try {
+    auto format = images::image_format_for(output_file, depth);
+    with_counter(counter_name, [&](auto count) {
+      using counter_type = decltype(count);
+      if constexpr(std::is_same_v<counter_type, uint32_t>) {
+        if(file) {
+          images::shared_image_data<> histogram(images::histogram_view(*file));
+          render_image(funcs, histogram, &*file, steps_done, tiles, single,
+                       precision, budget, filter, {gamma, hdr}, format,
+                       output_file, pool, timings, counters);
+          return;
+        }
+      }
+      images::shared_image_data<counter_type> histogram(dims);
+      render_image(funcs, histogram, nullptr, 0, tiles, single, precision,
+                   budget, filter, {gamma, hdr}, format, output_file, pool,
+                   timings, counters);
+    });
+  } catch(const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
   }
 
-  png_write_view(output_file, const_view(image));
+  if(show_stats)
+    stats::write_json(std::cout, *seed, timings, thread_stats);
 
   return 0;
 }
@@ -0,0 +1,204 @@
+#include "histogram_file.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace images {
+
+  namespace {
+    constexpr uint64_t page_size = 4096;
+
+    uint64_t round_up(uint64_t value, uint64_t align) {
+      return (value + align - 1) / align * align;
+    }
+
+    // The end of `count` items of `size` bytes starting at `offset`, or
+    // nullopt if that overflows.
+    std::optional<uint64_t> extent_end(uint64_t offset, uint64_t count,
+                                       uint64_t size) {
+      const uint64_t max = std::numeric_limits<uint64_t>::max();
+      if(size && count > max / size)
+        return std::nullopt;
+      if(count * size > max - offset)
+        return std::nullopt;
+      return offset + count * size;
+    }
+
+    // Check that the sections described by `h` are laid out in order
+    // without overlapping, lie within the file, and are aligned for their
+    // contents, so that nothing read through the mapping can stray outside
+    // it. Returns an error message, or nullptr if the layout is sound.
+    const char * check_layout(const histogram_header &h) {
+      const uint64_t max_dim = std::numeric_limits<ptrdiff_t>::max();
+      if(h.width == 0 || h.height == 0 || h.width > max_dim ||
+         h.height > max_dim)
+        return "has invalid dimensions";
+      auto pixels = extent_end(0, h.width, h.height);
+      auto entry_size = extent_end(0, h.palette_channels,
+                                   h.palette_channel_size);
+      if(!pixels || *pixels > max_dim || !entry_size)
+        return "is too large";
+
+      if(h.palette_offset < sizeof(histogram_header))
+        return "has a corrupt palette offset";
+      auto palette_end = extent_end(h.palette_offset, h.palette_size,
+                                    *entry_size);
+      if(!palette_end || h.color_offset < *palette_end ||
+         h.color_offset % alignof(double))
+        return "has a corrupt color offset";
+      auto color_end = extent_end(h.color_offset, *pixels, h.color_size);
+      if(!color_end || h.alpha_offset < *color_end ||
+         h.alpha_offset % alignof(uint64_t))
+        return "has a corrupt alpha offset";
+      auto alpha_end = extent_end(h.alpha_offset, *pixels, h.alpha_size);
+      if(!alpha_end || h.file_size < *alpha_end)
+        return "has a corrupt file size";
+      return nullptr;
+    }
+
+    [[noreturn]] void throw_errno(const std::string &what) {
+      throw std::system_error(errno, std::generic_category(), what);
+    }
+  }
+
+  histogram_file::histogram_file(
+    const std::string &filename,
+    const boost::gil::point2<ptrdiff_t> &dimensions, uint32_t color_size,
+    uint32_t alpha_size, uint32_t palette_channels,
+    uint32_t palette_channel_size, uint64_t palette_size, uint64_t flame_hash
+  ) {
+    histogram_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, histogram_header::file_magic, sizeof(h.magic));
+    h.version = histogram_header::current_version;
+    h.byte_order = histogram_header::native_byte_order;
+    h.width = dimensions.x;
+    h.height = dimensions.y;
+    h.color_size = color_size;
+    h.alpha_size = alpha_size;
+    h.palette_channels = palette_channels;
+    h.palette_channel_size = palette_channel_size;
+    h.palette_size = palette_size;
+    h.flame_hash = flame_hash;
+
+    // The palette goes right after the header; page-align the planes so that
+    // they map nicely.
+    uint64_t pixels = h.width * h.height;
+    h.palette_offset = round_up(sizeof(h), 16);
+    h.color_offset = round_up(
+      h.palette_offset + palette_size * palette_channels * palette_channel_size,
+      page_size
+    );
+    h.alpha_offset = round_up(
+      h.color_offset + pixels * color_size, page_size
+    );
+    h.file_size = h.alpha_offset + pixels * alpha_size;
+
+    fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd_ == -1)
+      throw_errno("unable to create " + filename);
+
+    try {
+      // Truncating the file to its full size leaves it sparse and zeroed.
+      if(::ftruncate(fd_, h.file_size) == -1)
+        throw_errno("unable to resize " + filename);
+
+      map(h.file_size);
+      std::memcpy(data_, &h, sizeof(h));
+    } catch(...) {
+      unmap();
+      throw;
+    }
+  }
+
+  histogram_file::histogram_file(const std::string &filename, bool writable) {
+    fd_ = ::open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+    if(fd_ == -1)
+      throw_errno("unable to open " + filename);
+
+    try {
+      histogram_header h;
+      if(::pread(fd_, &h, sizeof(h), 0) != sizeof(h) ||
+         std::memcmp(h.magic, histogram_header::file_magic, sizeof(h.magic)))
+        throw std::runtime_error(filename + " is not a histogram file");
+      if(h.version != histogram_header::current_version)
+        throw std::runtime_error(filename + " has an unsupported version");
+      if(h.byte_order != histogram_header::native_byte_order)
+        throw std::runtime_error(filename + " has the wrong byte order");
+      if(const char *error = check_layout(h))
+        throw std::runtime_error(filename + " " + error);
+
+      struct stat st;
+      if(::fstat(fd_, &st) == -1)
+        throw_errno("unable to stat " + filename);
+      if(static_cast<uint64_t>(st.st_size) < h.file_size)
+        throw std::runtime_error(filename + " is truncated");
+
+      map(h.file_size, writable);
+    } catch(...) {
+      unmap();
+      throw;
+    }
+  }
+
+  histogram_file::histogram_file(histogram_file &&other)
+    : fd_(std::exchange(other.fd_, -1)),
+      data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {}
+
+  histogram_file & histogram_file::operator =(histogram_file &&other) {
+    if(this != &other) {
+      unmap();
+      fd_ = std::exchange(other.fd_, -1);
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+  }
+
+  histogram_file::~histogram_file() {
+    unmap();
+  }
+
+  void histogram_file::checkpoint(uint64_t steps) {
+    // Flush the planes before the header so that the step count on disk
+    // never claims more than what's there. (The kernel may write back later
+    // hits before the next checkpoint too; those only add a little extra
+    // density, which tone mapping normalizes away.)
+    if(::msync(data_, size_, MS_SYNC) == -1)
+      throw_errno("unable to sync histogram");
+    static_cast<histogram_header*>(data_)->steps = steps;
+    if(::msync(data_, page_size, MS_SYNC) == -1)
+      throw_errno("unable to sync histogram");
+  }
+
+  void histogram_file::map(size_t size, bool writable) {
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    data_ = ::mmap(nullptr, size, prot, MAP_SHARED, fd_, 0);
+    if(data_ == MAP_FAILED) {
+      data_ = nullptr;
+      throw_errno("unable to map histogram");
+    }
+    size_ = size;
+  }
+
+  void histogram_file::unmap() {
+    if(data_)
+      ::munmap(data_, size_);
+    if(fd_ != -1)
+      ::close(fd_);
+    data_ = nullptr;
+    fd_ = -1;
+    size_ = 0;
+  }
+
+} // namespace images
@@ -0,0 +1,72 @@
+#include "pfm_writer.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include <sys/types.h>
+
+namespace images {
+
+  struct pfm_writer::state {
+    std::FILE *file = nullptr;
+    size_t width, height, rows_written = 0;
+    off_t data_offset;
+
+    ~state() {
+      if(file)
+        std::fclose(file);
+    }
+  };
+
+  pfm_writer::pfm_writer(const std::string &filename, size_t width,
+                         size_t height) : state_(std::make_unique<state>()) {
+    state_->width = width;
+    state_->height = height;
+
+    state_->file = std::fopen(filename.c_str(), "wb");
+    if(!state_->file)
+      throw std::runtime_error("unable to open " + filename);
+
+    // A negative scale means little-endian samples.
+    const uint16_t probe = 1;
+    bool little = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    std::string header = "PF\n" + std::to_string(width) + " " +
+      std::to_string(height) + "\n" + (little ? "-1.0" : "1.0") + "\n";
+    if(std::fwrite(header.data(), 1, header.size(), state_->file) !=
+       header.size())
+      throw std::runtime_error("error writing PFM file");
+    state_->data_offset = header.size();
+  }
+
+  pfm_writer::~pfm_writer() = default;
+
+  void pfm_writer::write_rows(const float *rows, size_t count) {
+    assert(state_->rows_written + count <= state_->height);
+
+    // Each row lands at its flipped position; the file is fixed-size, so
+    // rows can be written wherever they go.
+    const size_t stride = state_->width * 3;
+    for(size_t i = 0; i != count; i++) {
+      size_t y = state_->height - 1 - (state_->rows_written + i);
+      off_t offset = state_->data_offset + y * stride * sizeof(float);
+      if(::fseeko(state_->file, offset, SEEK_SET) != 0 ||
+         std::fwrite(rows + i * stride, sizeof(float), stride,
+                     state_->file) != stride)
+        throw std::runtime_error("error writing PFM file");
+    }
+    state_->rows_written += count;
+  }
+
+  void pfm_writer::finish() {
+    assert(state_->rows_written == state_->height);
+    if(std::fclose(state_->file) != 0) {
+      state_->file = nullptr;
+      throw std::runtime_error("error closing PFM file");
+    }
+    state_->file = nullptr;
+  }
+
+} // namespace images
@@ -0,0 +1,102 @@
+#include "png_writer.hpp"
+
+#include <cassert>
+#include <csetjmp>
+#include <cstdio>
+#include <stdexcept>
+
+#include <png.h>
+
+namespace images {
+
+  struct png_writer::state {
+    std::FILE *file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+    size_t width, height, stride, rows_written = 0;
+    std::string error;
+
+    ~state() {
+      if(png)
+        png_destroy_write_struct(&png, info ? &info : nullptr);
+      if(file)
+        std::fclose(file);
+    }
+  };
+
+  namespace {
+    void on_error(png_structp png, png_const_charp message) {
+      auto *s = static_cast<std::string*>(png_get_error_ptr(png));
+      *s = message;
+      png_longjmp(png, 1);
+    }
+
+    void on_warning(png_structp, png_const_charp) {}
+  }
+
+  png_writer::png_writer(const std::string &filename, size_t width,
+                         size_t height, int bit_depth)
+    : state_(std::make_unique<state>()) {
+    if(bit_depth != 8 && bit_depth != 16)
+      throw std::invalid_argument("PNG bit depth must be 8 or 16");
+    state_->width = width;
+    state_->height = height;
+    state_->stride = width * 3 * (bit_depth / 8);
+
+    state_->file = std::fopen(filename.c_str(), "wb");
+    if(!state_->file)
+      throw std::runtime_error("unable to open " + filename);
+
+    state_->png = png_create_write_struct(
+      PNG_LIBPNG_VER_STRING, &state_->error, on_error, on_warning
+    );
+    if(!state_->png)
+      throw std::runtime_error("unable to create PNG writer");
+    state_->info = png_create_info_struct(state_->png);
+    if(!state_->info)
+      throw std::runtime_error("unable to create PNG info");
+
+    if(setjmp(png_jmpbuf(state_->png)))
+      throw std::runtime_error(state_->error);
+
+    png_init_io(state_->png, state_->file);
+    png_set_IHDR(
+      state_->png, state_->info, width, height, bit_depth, PNG_COLOR_TYPE_RGB,
+      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+      PNG_FILTER_TYPE_DEFAULT
+    );
+    png_write_info(state_->png, state_->info);
+
+    // PNG stores 16-bit samples big-endian.
+    const uint16_t probe = 1;
+    if(bit_depth == 16 && *reinterpret_cast<const uint8_t*>(&probe) == 1)
+      png_set_swap(state_->png);
+  }
+
+  png_writer::~png_writer() = default;
+
+  void png_writer::write_rows(const void *rows, size_t count) {
+    assert(state_->rows_written + count <= state_->height);
+    if(setjmp(png_jmpbuf(state_->png)))
+      throw std::runtime_error(state_->error);
+
+    const auto *bytes = static_cast<const uint8_t*>(rows);
+    for(size_t i = 0; i != count; i++)
+      png_write_row(state_->png, bytes + i * state_->stride);
+    state_->rows_written += count;
+  }
+
+  void png_writer::finish() {
+    assert(state_->rows_written == state_->height);
+    if(setjmp(png_jmpbuf(state_->png)))
+      throw std::runtime_error(state_->error);
+
+    png_write_end(state_->png, nullptr);
+    if(std::fclose(state_->file) != 0) {
+      state_->file = nullptr;
+      throw std::runtime_error("error closing PNG file");
+    }
+    state_->file = nullptr;
+  }
+
+} // namespace images
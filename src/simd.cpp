@@ -0,0 +1,244 @@
+#include "simd.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define MUSPELHEIM_X86_DISPATCH
+#  include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#  define MUSPELHEIM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#  define MUSPELHEIM_ALWAYS_INLINE inline
+#endif
+
+namespace simd {
+
+  namespace {
+    std::atomic<instruction_set> active_isa(detect());
+
+    // Always inlined so that each target-specific kernel below gets a tail
+    // loop compiled for its own instruction set; calling between SSE and AVX
+    // code with dirty upper registers incurs a costly transition.
+    template<typename T>
+    MUSPELHEIM_ALWAYS_INLINE
+    void affine_scalar(const math::basic_affine_transform<T> &t, T *x, T *y,
+                       size_t n) {
+      for(size_t i = 0; i != n; i++) {
+        T px = x[i], py = y[i];
+        x[i] = t.a*px + t.b*py + t.c;
+        y[i] = t.d*px + t.e*py + t.f;
+      }
+    }
+
+    MUSPELHEIM_ALWAYS_INLINE
+    void tone_scalar(float *value, const float *brightness,
+                     const float *highlight, float scale, size_t n) {
+      for(size_t i = 0; i != n; i++) {
+        float v = value[i] * brightness[i];
+        value[i] = (v + (1 - v) * highlight[i]) * scale;
+      }
+    }
+
+#ifdef MUSPELHEIM_X86_DISPATCH
+    // No FMAs in the affine kernels (nor "fma" in the targets, which would
+    // let the compiler contract the scalar tails), so every instruction set
+    // computes bit-identical points and a seed gives the same render
+    // whichever one is active.
+    __attribute__((target("sse2")))
+    void affine_sse2(const math::affine_transform &t, double *x, double *y,
+                     size_t n) {
+      const __m128d a = _mm_set1_pd(t.a), b = _mm_set1_pd(t.b),
+                    c = _mm_set1_pd(t.c), d = _mm_set1_pd(t.d),
+                    e = _mm_set1_pd(t.e), f = _mm_set1_pd(t.f);
+
+      size_t i = 0;
+      for(; i + 2 <= n; i += 2) {
+        __m128d px = _mm_loadu_pd(x + i), py = _mm_loadu_pd(y + i);
+        __m128d nx = _mm_add_pd(
+          _mm_add_pd(_mm_mul_pd(a, px), _mm_mul_pd(b, py)), c
+        );
+        __m128d ny = _mm_add_pd(
+          _mm_add_pd(_mm_mul_pd(d, px), _mm_mul_pd(e, py)), f
+        );
+        _mm_storeu_pd(x + i, nx);
+        _mm_storeu_pd(y + i, ny);
+      }
+      affine_scalar(t, x + i, y + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    void affine_avx2(const math::affine_transform &t, double *x, double *y,
+                     size_t n) {
+      const __m256d a = _mm256_set1_pd(t.a), b = _mm256_set1_pd(t.b),
+                    c = _mm256_set1_pd(t.c), d = _mm256_set1_pd(t.d),
+                    e = _mm256_set1_pd(t.e), f = _mm256_set1_pd(t.f);
+
+      size_t i = 0;
+      for(; i + 4 <= n; i += 4) {
+        __m256d px = _mm256_loadu_pd(x + i), py = _mm256_loadu_pd(y + i);
+        __m256d nx = _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(a, px), _mm256_mul_pd(b, py)), c
+        );
+        __m256d ny = _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(d, px), _mm256_mul_pd(e, py)), f
+        );
+        _mm256_storeu_pd(x + i, nx);
+        _mm256_storeu_pd(y + i, ny);
+      }
+      affine_scalar(t, x + i, y + i, n - i);
+    }
+
+    __attribute__((target("sse2")))
+    void affine_sse2(const math::basic_affine_transform<float> &t, float *x,
+                     float *y, size_t n) {
+      const __m128 a = _mm_set1_ps(t.a), b = _mm_set1_ps(t.b),
+                   c = _mm_set1_ps(t.c), d = _mm_set1_ps(t.d),
+                   e = _mm_set1_ps(t.e), f = _mm_set1_ps(t.f);
+
+      size_t i = 0;
+      for(; i + 4 <= n; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i);
+        __m128 nx = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(a, px), _mm_mul_ps(b, py)), c
+        );
+        __m128 ny = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(d, px), _mm_mul_ps(e, py)), f
+        );
+        _mm_storeu_ps(x + i, nx);
+        _mm_storeu_ps(y + i, ny);
+      }
+      affine_scalar(t, x + i, y + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    void affine_avx2(const math::basic_affine_transform<float> &t, float *x,
+                     float *y, size_t n) {
+      const __m256 a = _mm256_set1_ps(t.a), b = _mm256_set1_ps(t.b),
+                   c = _mm256_set1_ps(t.c), d = _mm256_set1_ps(t.d),
+                   e = _mm256_set1_ps(t.e), f = _mm256_set1_ps(t.f);
+
+      size_t i = 0;
+      for(; i + 8 <= n; i += 8) {
+        __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i);
+        __m256 nx = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(a, px), _mm256_mul_ps(b, py)), c
+        );
+        __m256 ny = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(d, px), _mm256_mul_ps(e, py)), f
+        );
+        _mm256_storeu_ps(x + i, nx);
+        _mm256_storeu_ps(y + i, ny);
+      }
+      affine_scalar(t, x + i, y + i, n - i);
+    }
+
+    // No FMAs here, so that these round exactly like tone_scalar().
+    __attribute__((target("sse2")))
+    void tone_sse2(float *value, const float *brightness,
+                   const float *highlight, float scale, size_t n) {
+      const __m128 one = _mm_set1_ps(1), s = _mm_set1_ps(scale);
+
+      size_t i = 0;
+      for(; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(value + i),
+                              _mm_loadu_ps(brightness + i));
+        __m128 h = _mm_mul_ps(_mm_sub_ps(one, v), _mm_loadu_ps(highlight + i));
+        _mm_storeu_ps(value + i, _mm_mul_ps(_mm_add_ps(v, h), s));
+      }
+      tone_scalar(value + i, brightness + i, highlight + i, scale, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    void tone_avx2(float *value, const float *brightness,
+                   const float *highlight, float scale, size_t n) {
+      const __m256 one = _mm256_set1_ps(1), s = _mm256_set1_ps(scale);
+
+      size_t i = 0;
+      for(; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(value + i),
+                                 _mm256_loadu_ps(brightness + i));
+        __m256 h = _mm256_mul_ps(_mm256_sub_ps(one, v),
+                                 _mm256_loadu_ps(highlight + i));
+        _mm256_storeu_ps(value + i, _mm256_mul_ps(_mm256_add_ps(v, h), s));
+      }
+      tone_scalar(value + i, brightness + i, highlight + i, scale, n - i);
+    }
+#endif
+  }
+
+  instruction_set detect() {
+#ifdef MUSPELHEIM_X86_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+      return instruction_set::avx2;
+    if(__builtin_cpu_supports("sse2"))
+      return instruction_set::sse2;
+#endif
+    return instruction_set::scalar;
+  }
+
+  instruction_set active() {
+    return active_isa.load(std::memory_order_relaxed);
+  }
+
+  void set_active(instruction_set isa) {
+    active_isa.store(std::min(isa, detect()), std::memory_order_relaxed);
+  }
+
+  const char * name(instruction_set isa) {
+    switch(isa) {
+    case instruction_set::avx2:
+      return "avx2";
+    case instruction_set::sse2:
+      return "sse2";
+    default:
+      return "scalar";
+    }
+  }
+
+  void affine(const math::affine_transform &t, double *x, double *y,
+              size_t n) {
+    switch(active()) {
+#ifdef MUSPELHEIM_X86_DISPATCH
+    case instruction_set::avx2:
+      return affine_avx2(t, x, y, n);
+    case instruction_set::sse2:
+      return affine_sse2(t, x, y, n);
+#endif
+    default:
+      return affine_scalar(t, x, y, n);
+    }
+  }
+
+  void affine(const math::basic_affine_transform<float> &t, float *x,
+              float *y, size_t n) {
+    switch(active()) {
+#ifdef MUSPELHEIM_X86_DISPATCH
+    case instruction_set::avx2:
+      return affine_avx2(t, x, y, n);
+    case instruction_set::sse2:
+      return affine_sse2(t, x, y, n);
+#endif
+    default:
+      return affine_scalar(t, x, y, n);
+    }
+  }
+
+  void tone(float *value, const float *brightness, const float *highlight,
+            float scale, size_t n) {
+    switch(active()) {
+#ifdef MUSPELHEIM_X86_DISPATCH
+    case instruction_set::avx2:
+      return tone_avx2(value, brightness, highlight, scale, n);
+    case instruction_set::sse2:
+      return tone_sse2(value, brightness, highlight, scale, n);
+#endif
+    default:
+      return tone_scalar(value, brightness, highlight, scale, n);
+    }
+  }
+
+} // namespace simd
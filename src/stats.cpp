@@ -0,0 +1,76 @@
+#include "stats.hpp"
+
+#include <algorithm>
+
+namespace stats {
+
+  namespace {
+    double seconds(clock::duration d) {
+      return std::chrono::duration<double>(d).count();
+    }
+
+    void write_counters(std::ostream &os, const counters &c,
+                        const std::string &indent) {
+      os << "{\n"
+         << indent << "  \"iterations\": " << c.iterations << ",\n"
+         << indent << "  \"off_canvas\": " << c.off_canvas << ",\n"
+         << indent << "  \"non_finite\": " << c.non_finite << ",\n"
+         << indent << "  \"picks\": [";
+      for(size_t i = 0; i != c.picks.size(); i++)
+        os << (i ? ", " : "") << c.picks[i];
+      os << "],\n"
+         << indent << "  \"flushes\": " << c.flushes << ",\n"
+         << indent << "  \"busy_seconds\": " << seconds(c.busy_time) << ",\n"
+         << indent << "  \"flush_seconds\": " << seconds(c.flush_time) << "\n"
+         << indent << "}";
+    }
+  }
+
+  counters & counters::operator +=(const counters &rhs) {
+    iterations += rhs.iterations;
+    off_canvas += rhs.off_canvas;
+    non_finite += rhs.non_finite;
+
+    picks.resize(std::max(picks.size(), rhs.picks.size()), 0);
+    for(size_t i = 0; i != rhs.picks.size(); i++)
+      picks[i] += rhs.picks[i];
+
+    flushes += rhs.flushes;
+    busy_time += rhs.busy_time;
+    flush_time += rhs.flush_time;
+    return *this;
+  }
+
+  void timings::add(const std::string &name, clock::duration d) {
+    auto i = std::find_if(stages_.begin(), stages_.end(), [&](auto &&s) {
+      return s.first == name;
+    });
+    if(i == stages_.end())
+      stages_.emplace_back(name, d);
+    else
+      i->second += d;
+  }
+
+  void write_json(std::ostream &os, uint64_t seed, const timings &t,
+                  const std::vector<counters> &threads) {
+    counters total;
+    for(const auto &c : threads)
+      total += c;
+
+    os << "{\n  \"seed\": " << seed << ",\n  \"stages\": {";
+    for(size_t i = 0; i != t.stages().size(); i++) {
+      const auto &s = t.stages()[i];
+      os << (i ? ",\n" : "\n") << "    \"" << s.first << "\": "
+         << seconds(s.second);
+    }
+    os << "\n  },\n  \"total\": ";
+    write_counters(os, total, "  ");
+    os << ",\n  \"threads\": [";
+    for(size_t i = 0; i != threads.size(); i++) {
+      os << (i ? ", " : "");
+      write_counters(os, threads[i], "    ");
+    }
+    os << "]\n}" << std::endl;
+  }
+
+} // namespace stats
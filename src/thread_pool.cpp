@@ -0,0 +1,133 @@
+#include "thread_pool.hpp"
+
+namespace parallel {
+
+  namespace {
+    thread_local const thread_pool *current_pool = nullptr;
+    thread_local size_t current_index = thread_pool::no_worker;
+  }
+
+  thread_pool::thread_pool(size_t threads) : queued_(0) {
+    if(threads == 0)
+      threads = 1;
+    for(size_t i = 0; i != threads; i++)
+      queues_.push_back(std::make_unique<queue>());
+    for(size_t i = 0; i != threads; i++)
+      threads_.emplace_back([this, i]() { run(i); });
+  }
+
+  thread_pool::~thread_pool() {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      stopping_ = true;
+    }
+    work_available_.notify_all();
+    for(auto &t : threads_)
+      t.join();
+  }
+
+  size_t thread_pool::default_size() {
+    auto n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+  }
+
+  void thread_pool::submit(task t) {
+    size_t index = current_worker();
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      unfinished_++;
+      if(index == no_worker)
+        index = next_queue_++ % size();
+    }
+
+    {
+      // Count the task before it can be popped, so that queued_ never dips
+      // below zero.
+      std::lock_guard<std::mutex> guard(queues_[index]->lock);
+      queued_++;
+      queues_[index]->tasks.push_back(std::move(t));
+    }
+
+    {
+      // Take the lock so that a worker can't miss the notification between
+      // checking queued_ and going to sleep.
+      std::lock_guard<std::mutex> guard(lock_);
+    }
+    work_available_.notify_one();
+  }
+
+  void thread_pool::wait() {
+    std::unique_lock<std::mutex> guard(lock_);
+    all_done_.wait(guard, [this]() { return unfinished_ == 0; });
+    if(error_) {
+      auto error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  size_t thread_pool::current_worker() const {
+    return current_pool == this ? current_index : no_worker;
+  }
+
+  void thread_pool::run(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    for(;;) {
+      task t;
+      if(pop(index, t)) {
+        std::exception_ptr error;
+        try {
+          t();
+        } catch(...) {
+          error = std::current_exception();
+        }
+        finish(error);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> guard(lock_);
+      work_available_.wait(guard, [this]() {
+        return stopping_ || queued_ > 0;
+      });
+      if(stopping_ && queued_ == 0)
+        return;
+    }
+  }
+
+  bool thread_pool::pop(size_t index, task &t) {
+    {
+      auto &own = *queues_[index];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if(!own.tasks.empty()) {
+        t = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        queued_--;
+        return true;
+      }
+    }
+
+    for(size_t i = 1; i != size(); i++) {
+      auto &victim = *queues_[(index + i) % size()];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if(!victim.tasks.empty()) {
+        t = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        queued_--;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void thread_pool::finish(std::exception_ptr error) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if(error && !error_)
+      error_ = error;
+    if(--unfinished_ == 0)
+      all_done_.notify_all();
+  }
+
+} // namespace parallel
@@ -0,0 +1,193 @@
+#include "density_filter.hpp"
+#include "histogram_file.hpp"
+#include "image_writer.hpp"
+#include "images.hpp"
+#include "program_options.hpp"
+#include "thread_pool.hpp"
+
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/gil/typedefs.hpp>
+
+#include <sys/stat.h>
+
+// Whether `a` and `b` name the same existing file, even by different paths.
+static bool same_file(const std::string &a, const std::string &b) {
+  struct stat sa, sb;
+  if(::stat(a.c_str(), &sa) == -1 || ::stat(b.c_str(), &sb) == -1)
+    return false;
+  return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Merge histogram files from several partial renders of the same flame (e.g.
+// from separate processes or machines, each run with --histogram) into a
+// single histogram and/or image.
+int main(int argc, const char *argv[]) {
+  using namespace boost::gil;
+  using rgb8 = rgb8_pixel_t;
+  namespace opts = boost::program_options;
+
+  bool show_help = false;
+  std::vector<std::string> input_files;
+  std::optional<std::string> output_file;
+  std::optional<std::string> histogram_file;
+  size_t num_jobs = 1;
+  double gamma = 1.0;
+  std::optional<double> hdr;
+  int depth = 8;
+  images::filter_options filter;
+
+  opts::options_description generic_opts("Generic options");
+  generic_opts.add_options()
+    ("help,h", opts::value(&show_help)->zero_tokens(), "show help")
+    ("output,o", opts::value(&output_file)->value_name("FILE"),
+     "write the merged image to FILE")
+    ("histogram", opts::value(&histogram_file)->value_name("FILE"),
+     "write the merged histogram to FILE")
+    ("jobs,j", opts::value(&num_jobs)->value_name("JOBS"),
+     "number of worker threads")
+  ;
+
+  opts::options_description image_opts("Image options");
+  image_opts.add_options()
+    ("gamma,g", opts::value(&gamma)->value_name("GAMMA"), "gamma adjustment")
+    ("hdr,H", opts::value(&hdr)->implicit_value(1.0, "1.0")->value_name("HDR"),
+     "enable HDR")
+    ("oversample", opts::value(&filter.oversample)->value_name("N"),
+     "the histograms were rendered with --oversample N (default: 1)")
+    ("de", opts::value(&filter.de_max_radius)->value_name("RADIUS"),
+     "blur sparse pixels by density estimation, up to RADIUS pixels for a "
+     "single hit (e.g. 9; default: off)")
+    ("de-min", opts::value(&filter.de_min_radius)->value_name("RADIUS"),
+     "smallest density estimation radius (default: 0)")
+    ("de-curve", opts::value(&filter.de_curve)->value_name("CURVE"),
+     "how fast the density estimation radius shrinks with the hit count "
+     "(default: 0.4)")
+    ("depth,d", opts::value(&depth)->value_name("BITS"),
+     "bits per channel for PNG output: 8 or 16 (default: 8); output files "
+     "ending in .pfm are written as 32-bit float PFM instead")
+  ;
+
+  opts::options_description hidden_opts("Hidden options");
+  hidden_opts.add_options()
+    ("input-file", opts::value(&input_files), "input file")
+  ;
+  opts::positional_options_description pos;
+  pos.add("input-file", -1);
+
+  try {
+    opts::options_description all_opts;
+    all_opts.add(generic_opts).add(image_opts).add(hidden_opts);
+    auto parsed = opts::command_line_parser(argc, argv)
+      .options(all_opts).positional(pos).run();
+
+    opts::variables_map vm;
+    opts::store(parsed, vm);
+    opts::notify(vm);
+  } catch(const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+
+  if(show_help) {
+    std::cout << "usage: " << argv[0] << " [OPTION]... HISTOGRAM..."
+              << std::endl;
+    opts::options_description displayed;
+    displayed.add(generic_opts).add(image_opts);
+    std::cout << displayed << std::endl;
+    return 0;
+  }
+
+  if(input_files.empty()) {
+    std::cerr << "no input histograms" << std::endl;
+    return 2;
+  }
+  if(depth != 8 && depth != 16) {
+    std::cerr << "--depth must be 8 or 16" << std::endl;
+    return 2;
+  }
+  if(filter.oversample == 0) {
+    std::cerr << "--oversample must be positive" << std::endl;
+    return 2;
+  }
+  if(!output_file && !histogram_file) {
+    std::cerr << "nothing to do; pass --output and/or --histogram"
+              << std::endl;
+    return 2;
+  }
+
+  // Creating the output truncates it, which would pull the rug out from
+  // under an input mapped from the same file.
+  if(histogram_file) {
+    for(const auto &name : input_files) {
+      if(same_file(name, *histogram_file)) {
+        std::cerr << "--histogram " << *histogram_file << " is also an input"
+                  << std::endl;
+        return 2;
+      }
+    }
+  }
+
+  parallel::thread_pool pool(num_jobs);
+  try {
+    // The inputs are only read, so map them read-only; the page cache streams
+    // them in as the merge walks through the rows.
+    std::vector<images::histogram_file> inputs;
+    std::vector<images::raw_image_view<>> srcs;
+    uint64_t steps = 0;
+    for(const auto &name : input_files) {
+      inputs.emplace_back(name, false);
+      const auto &h = inputs.back().header();
+      const auto &first = inputs.front().header();
+      if(h.flame_hash != first.flame_hash)
+        throw std::runtime_error(name + " is for another flame");
+      if(inputs.back().dimensions() != inputs.front().dimensions())
+        throw std::runtime_error(name + " has another size");
+      srcs.push_back(images::histogram_view(inputs.back()));
+      steps += h.steps;
+    }
+
+    // The inputs all come from the same flame, so they share a palette.
+    auto dims = inputs.front().dimensions();
+    const ptrdiff_t oversample = filter.oversample;
+    if(output_file && (dims.x % oversample || dims.y % oversample))
+      throw std::runtime_error(input_files.front() + " has another "
+                               "oversampling factor");
+    auto palette = images::histogram_palette<rgb8>(inputs.front());
+    std::optional<images::histogram_file> file;
+    std::optional<images::raw_image_data<>> data;
+    images::raw_image_view<> dst;
+    if(histogram_file) {
+      file = images::create_histogram_file(
+        *histogram_file, dims, palette, inputs.front().header().flame_hash
+      );
+      dst = images::histogram_view(*file);
+    } else {
+      data.emplace(dims);
+      dst = data->view();
+    }
+
+    images::merge(srcs, dst, &pool);
+    if(file)
+      file->checkpoint(steps);
+    if(output_file) {
+      auto format = images::image_format_for(*output_file, depth);
+      if(filter.trivial()) {
+        images::write_image(*output_file, dst, palette, {gamma, hdr}, format,
+                            &pool);
+      } else {
+        auto filtered = images::filter_histogram(dst, filter, &pool);
+        images::write_image(*output_file, filtered.view(), palette,
+                            {gamma, hdr}, format, &pool);
+      }
+    }
+  } catch(const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
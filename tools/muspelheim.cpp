@@ -0,0 +1,5 @@
+#include <muspelheim.hpp>
+
+// The driver without a built-in flame: every flame comes from --flame, so
+// new flames can be rendered (and previewed) without a rebuild.
+muspelheim::flame_function_system muspelheim::function_system({});